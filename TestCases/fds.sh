@@ -0,0 +1,26 @@
+sh -c 'ls /proc/$PPID/fd' > fds_before.txt
+show() {
+    echo $1 > fds_copy.txt
+    cat < fds_scratch.txt > /dev/null
+}
+for i in 1 2 3 4 5 6 7 8 9 10
+do
+    echo $i > fds_scratch.txt
+    printf "%s\n" $i > fds_copy.txt
+    pwd > /dev/null
+    cat < fds_scratch.txt | cat > /dev/null
+    cat fds_scratch.txt | tee fds_copy.txt > /dev/null
+    test -f fds_scratch.txt > /dev/null
+    then true < fds_scratch.txt
+    else false
+    show $i > /dev/null
+    cat < fds_missing.txt
+    echo lost > fds_missing_dir/x.txt
+    /bin/true > /dev/null
+    cd .. > /dev/null
+    cd TestCases
+done
+sh -c 'ls /proc/$PPID/fd' > fds_after.txt
+diff fds_before.txt fds_after.txt
+then echo descriptors unchanged
+rm fds_before.txt fds_after.txt fds_scratch.txt fds_copy.txt
@@ -0,0 +1,26 @@
+f() {
+    for x in a b c
+    do
+        echo in f $x
+    done
+}
+for y in 1 2
+do
+    echo outside $y
+done
+f
+count() {
+    for x in $1 $2
+    do
+        for y in 1 2
+        do
+            echo $x $y
+        done
+    done
+}
+for z in 3
+do
+    echo loop $z
+done
+count p q
+f
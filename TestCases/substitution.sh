@@ -0,0 +1,16 @@
+echo "[$(echo a  b)]"
+echo [$(echo a  b)]
+printf '<%s>\n' $(echo 'test?.txt' input)
+printf '<%s>\n' "$(echo 'test?.txt' input)"
+printf '<%s>\n' $(printf 'x y\n\n\n')
+printf '<%s>\n' $(echo '"q"' "it's")
+printf '<%s>\n' "$(printf '%s\n' one two)"
+printf '<%s>\n' pre$(echo mid)post
+echo $(echo $(echo nested) | tr a-z A-Z)
+echo $(cat < testa.txt)
+echo $(false) status $?
+echo $(true) status $?
+for f in $(echo 'test[ab].txt')
+do
+echo item $f
+done
@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Benchmarks for the hot paths of mysh, run against a (release) build of the shell.
+// Usage: bench MYSH [BASELINE.json] [RESULTS.json]
+// Results are printed and written as JSON; with a baseline, every metric is compared to it
+// and the exit status is 1 if any of them got worse by more than BENCH_TOLERANCE (0.25).
+// Timings are only held against a baseline recorded on the same kind of machine (CPU model
+// and count); against another one they are shown, and only the counts can fail.
+// BENCH_DIR sets the scratch directory and BENCH_GLOB_SIZES the wildcard directory sizes.
+
+#define MAX_METRICS 32
+#define RUNS 3 // Each measurement is the best of this many runs
+
+// One measured number, whether larger values are better and whether it is a timing, which
+// depends on the machine, rather than a count
+typedef struct {
+    char name[64];
+    double value;
+    bool higher_is_better;
+    bool timing;
+} metric_t;
+
+metric_t metrics[MAX_METRICS];
+int nmetrics = 0;
+const char *mysh;      // Shell under test
+char workdir[4096];    // Scratch directory for scripts and files
+char host[256];        // CPU model and count, stored with the results
+
+// Reads the monotonic clock in seconds
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Records a result
+void add_metric(const char* name, double value, bool higher_is_better) {
+    metric_t *m = &metrics[nmetrics++];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->value = value;
+    m->higher_is_better = higher_is_better;
+    m->timing = true;
+    printf("  %-24s %14.3f\n", name, value);
+    fflush(stdout);
+}
+
+// Records a result that does not depend on the machine, where smaller is better
+void add_count(const char* name, double value) {
+    add_metric(name, value, false);
+    metrics[nmetrics - 1].timing = false;
+}
+
+// Describes the machine as its CPU model and the number of CPUs online
+void describe_host() {
+    char model[200] = "unknown CPU";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    char line[512];
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            snprintf(model, sizeof(model), "%s", colon + 2);
+            model[strcspn(model, "\n")] = '\0';
+            break;
+        }
+    }
+    if (f != NULL)
+        fclose(f);
+    for (char *c = model; *c != '\0'; c++)
+        if (*c == '"' || *c == '\\')
+            *c = ' ';
+    snprintf(host, sizeof(host), "%s x %ld", model, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// Returns the path of a file in the scratch directory; it stays valid until the next call
+char *work_path(const char* name) {
+    static char path[4096 + 256];
+    snprintf(path, sizeof(path), "%s/%s", workdir, name);
+    return path;
+}
+
+// Runs a program in the scratch directory with its output discarded and returns the wall
+// time in seconds
+double run_program(char* const argv[]) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        chdir(workdir);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "bench: %s exited abnormally on %s\n", argv[0], argv[1]);
+    return now() - start;
+}
+
+// Runs the shell on a script with its output discarded and returns the wall time in seconds
+double run_script(const char* script) {
+    char *argv[] = {(char*)mysh, (char*)script, NULL};
+    return run_program(argv);
+}
+
+// Best of RUNS runs of a program run n times in a row, in seconds per run
+double best_per_run(char* const argv[], long n) {
+    double best = 1e30;
+    for (int r = 0; r < RUNS; r++) {
+        double start = now();
+        for (long i = 0; i < n; i++)
+            run_program(argv);
+        double t = (now() - start) / n;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+// Best of RUNS runs of a script
+double best_of(const char* script) {
+    double best = 1e30;
+    for (int i = 0; i < RUNS; i++) {
+        double t = run_script(script);
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+// Creates a script in the scratch directory with n copies of line and returns its path
+char *write_script(const char* name, const char* line, long n) {
+    char *path = work_path(name);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < n; i++)
+        fputs(line, f);
+    fclose(f);
+    return path;
+}
+
+// Commands per second for a script of many short external commands
+void bench_batch() {
+    long n = 2000;
+    char *script = write_script("batch.sh", "/bin/true\n", n); // true itself is a builtin
+    add_metric("batch_cmds_per_sec", n / best_of(script), true);
+}
+
+// Compares doubles for qsort
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Per-command latency from launch to reaping, as reported by the shell's time -o records
+void bench_latency() {
+    long n = 1000;
+    char line[8192];
+    snprintf(line, sizeof(line), "time -o %s /bin/true\n", work_path("latency.json"));
+    unlink(work_path("latency.json"));
+    char *script = write_script("latency.sh", line, n);
+    for (int i = 0; i < RUNS; i++)
+        run_script(script);
+
+    // All runs are pooled, which evens out a run disturbed by other activity
+    double *samples = malloc(RUNS * n * sizeof(double));
+    int count = 0;
+    FILE *f = fopen(work_path("latency.json"), "r");
+    while (f != NULL && count < RUNS * n && fgets(line, sizeof(line), f) != NULL) {
+        char *real = strstr(line, "\"real\": ");
+        if (real != NULL)
+            samples[count++] = atof(real + 8) * 1e6;
+    }
+    if (f != NULL)
+        fclose(f);
+    if (count == 0) {
+        fprintf(stderr, "bench: no latency samples\n");
+        free(samples);
+        return;
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    add_metric("launch_p50_us", samples[count / 2], false);
+    add_metric("launch_p99_us", samples[count * 99 / 100], false);
+    free(samples);
+}
+
+// read_command throughput on a 50 MB script of comment lines, which do nothing once read
+void bench_read() {
+    const char *line = "# a comment line that the shell reads, lexes and throws away....\n";
+    long n = 50L * 1024 * 1024 / strlen(line);
+    char *script = write_script("read.sh", line, n);
+    add_metric("read_mb_per_sec", n * strlen(line) / (1024.0 * 1024.0) / best_of(script), true);
+}
+
+// Time per wildcard expansion over a directory of n files, with a pattern that has to be
+// tested against every name
+void bench_glob(long n) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "glob%ld", n);
+    mkdir(work_path(dir), 0755);
+    for (long i = 0; i < n; i++) {
+        char name[128];
+        snprintf(name, sizeof(name), "%s/file%07ld.txt", dir, i);
+        int fd = open(work_path(name), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    int globs = n < 200000 ? 1000000 / n : 5; // Small directories are expanded more often
+    char line[128];
+    snprintf(line, sizeof(line), "echo %s/*7.txt > /dev/null\n", dir);
+    char *script = write_script("glob.sh", line, globs);
+    char metric[64];
+    snprintf(metric, sizeof(metric), "glob_%ld_ms", n);
+    add_metric(metric, best_of(script) / globs * 1e3, false);
+
+    // The tree is removed again so that large sizes do not linger in the scratch directory
+    for (long i = 0; i < n; i++) {
+        char name[128];
+        snprintf(name, sizeof(name), "%s/file%07ld.txt", dir, i);
+        unlink(work_path(name));
+    }
+    rmdir(work_path(dir));
+}
+
+// A million passes through the body of six nested for loops against the same million commands
+// written out line by line, as a script generator would. The loop is compiled once, so its
+// body is never lexed again; only its variables are substituted on every pass.
+void bench_loop() {
+    const char *names = "abcdef";
+    long n = 1000000;
+    char *script = work_path("loop.sh");
+    FILE *f = fopen(script, "w");
+    if (f == NULL) {
+        perror(script);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 6; i++)
+        fprintf(f, "%*sfor %c in 0 1 2 3 4 5 6 7 8 9\n", 4 * i, "", names[i]);
+    fprintf(f, "%*stest $a$b$c$d$e$f = x\n", 24, "");
+    for (int i = 5; i >= 0; i--)
+        fprintf(f, "%*sdone\n", 4 * i, "");
+    fclose(f);
+    add_metric("loop_iters_per_sec", n / best_of(script), true);
+
+    script = work_path("unrolled.sh");
+    f = fopen(script, "w");
+    if (f == NULL) {
+        perror(script);
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < n; i++)
+        fprintf(f, "test %06ld = x\n", i);
+    fclose(f);
+    add_metric("unrolled_lines_per_sec", n / best_of(script), true);
+}
+
+// Latency of a short job run by a fresh shell against the same job sent by mysh-client to a
+// shell started with --serve. The client is expected next to the shell under test.
+void bench_serve() {
+    char client[4096 + 64], sock[4096 + 256], script[4096 + 256];
+    snprintf(client, sizeof(client), "%.*s/mysh-client", (int)(strrchr(mysh, '/') - mysh), mysh);
+    if (access(client, X_OK) != 0) {
+        printf("  (no %s, skipping the server benchmark)\n", client);
+        return;
+    }
+    snprintf(script, sizeof(script), "%s", write_script("job.sh", "true\n", 1));
+    snprintf(sock, sizeof(sock), "%s", work_path("mysh.sock"));
+    long n = 1000;
+    char *direct[] = {(char*)mysh, script, NULL};
+    add_metric("job_direct_us", best_per_run(direct, n) * 1e6, false);
+
+    unlink(sock);
+    pid_t server = fork();
+    if (server == 0) {
+        execl(mysh, mysh, "--serve", sock, (char*)NULL);
+        _exit(127);
+    }
+    // Until the server listens: the socket exists from bind() on, but refuses connections
+    // until listen()
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%.*s", (int)sizeof(addr.sun_path) - 1, sock);
+    for (int i = 0; i < 1000; i++) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        int connected = connect(probe, (struct sockaddr*)&addr, sizeof(addr));
+        close(probe);
+        if (connected == 0)
+            break;
+        usleep(1000);
+    }
+    char *served[] = {client, sock, script, NULL};
+    add_metric("job_served_us", best_per_run(served, n) * 1e6, false);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(sock);
+}
+
+// Throughput of a two-stage pipeline moving 512 MB
+void bench_pipe() {
+    long mb = 512;
+    char line[128];
+    snprintf(line, sizeof(line), "head -c %ld /dev/zero | cat > /dev/null\n", mb * 1024 * 1024);
+    char *script = write_script("pipe.sh", line, 1);
+    add_metric("pipe_mb_per_sec", mb / best_of(script), true);
+}
+
+// Reads a number written to a file in the scratch directory, or returns -1
+long read_number(const char* name) {
+    FILE *f = fopen(work_path(name), "r");
+    long n = -1;
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &n) != 1)
+            n = -1;
+        fclose(f);
+    }
+    return n;
+}
+
+// Runs the shell on a script under ptrace and returns the number of system calls the shell
+// itself made, not counting its children, or -1 if tracing is not allowed
+long count_syscalls(const char* script) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        chdir(workdir);
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+            _exit(126);
+        execl(mysh, mysh, script, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    long stops = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0 && waitpid(pid, &status, 0) == pid &&
+           WIFSTOPPED(status))
+        stops += WSTOPSIG(status) == (SIGTRAP | 0x80);
+    return stops / 2; // One stop on entry and one on exit
+}
+
+// Descriptors and system calls of commands the shell runs itself. The shell's open
+// descriptors are counted by a command before and after 100k builtins with and without
+// redirection, including skipped then/else lines, and must not grow. The system calls per
+// command are counted with ptrace, less those of starting and ending the shell.
+void bench_fds() {
+    const char *count = "sh -c 'ls /proc/$PPID/fd | wc -l > %s'\n";
+    long n = 100000;
+    char script[4096 + 256];
+    snprintf(script, sizeof(script), "%s", work_path("fds.sh"));
+    FILE *f = fopen(script, "w");
+    if (f == NULL) {
+        perror(script);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, count, "fds_before.txt");
+    const char *lines[] = {"echo x > /dev/null\n", "true\n", "then pwd > /dev/null\n", "false\n",
+                           "then true\n", "else cat < /dev/null\n", "test -d / > /dev/null\n", ":\n"};
+    for (long i = 0; i < n; i++)
+        fputs(i % 1000 == 999 ? "/bin/true\n" : lines[i % 8], f);
+    fprintf(f, count, "fds_after.txt");
+    fclose(f);
+    unlink(work_path("fds_before.txt"));
+    unlink(work_path("fds_after.txt"));
+    run_script(script);
+    long before = read_number("fds_before.txt"), after = read_number("fds_after.txt");
+    if (before < 0 || after < 0)
+        fprintf(stderr, "bench: no descriptor counts\n");
+    else
+        add_count("fd_growth", after - before);
+
+    long calls = 10000;
+    char *empty = write_script("empty.sh", "", 0);
+    long base = count_syscalls(empty);
+    long total = count_syscalls(write_script("syscalls.sh", "echo x > /dev/null\ntrue\n", calls / 2));
+    if (base < 0 || total < 0)
+        printf("  (ptrace not allowed, skipping the system call count)\n");
+    else
+        add_count("syscalls_per_cmd", (double)(total - base) / calls);
+}
+
+// Writes the results as a flat JSON object
+void write_results(const char* path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    fprintf(f, "{\n  \"host\": \"%s\",\n", host);
+    for (int i = 0; i < nmetrics; i++)
+        fprintf(f, "  \"%s\": %.3f%s\n", metrics[i].name, metrics[i].value, i + 1 < nmetrics ? "," : "");
+    fprintf(f, "}\n");
+    fclose(f);
+}
+
+// Compares the results with a baseline written by an earlier run.
+// Returns the number of metrics that regressed by more than the tolerance.
+int compare_baseline(const char* path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("No baseline at %s; run 'make bench-baseline' to record one\n", path);
+        return 0;
+    }
+    char text[8192];
+    size_t len = fread(text, 1, sizeof(text) - 1, f);
+    text[len] = '\0';
+    fclose(f);
+
+    const char *tolerance_env = getenv("BENCH_TOLERANCE");
+    double tolerance = tolerance_env != NULL ? atof(tolerance_env) : 0.25;
+    int regressions = 0;
+
+    // Timings taken on another machine are no reference
+    char base_host[256] = "";
+    char *h = strstr(text, "\"host\": \"");
+    if (h != NULL) {
+        h += strlen("\"host\": \"");
+        snprintf(base_host, sizeof(base_host), "%.*s", (int)strcspn(h, "\""), h);
+    }
+    bool same_host = strcmp(base_host, host) == 0;
+    if (!same_host)
+        printf("\nThe baseline was recorded on %s, this is %s:\n"
+               "timings are compared but only counts can fail\n",
+               base_host[0] != '\0' ? base_host : "an unknown machine", host);
+    printf("\n  %-24s %14s %14s %8s\n", "metric", "baseline", "current", "change");
+    for (int i = 0; i < nmetrics; i++) {
+        metric_t *m = &metrics[i];
+        char key[80];
+        snprintf(key, sizeof(key), "\"%.63s\":", m->name);
+        char *found = strstr(text, key);
+        if (found == NULL) {
+            printf("  %-24s %14s %14.3f\n", m->name, "-", m->value);
+            continue;
+        }
+        double base = atof(found + strlen(key));
+        // A metric that should stay at 0, such as fd_growth, counts any change as 100%
+        double change = base != 0 ? (m->value - base) / base : (m->value > 0) - (m->value < 0);
+        bool worse = m->higher_is_better ? change < -tolerance : change > tolerance;
+        bool fails = worse && (same_host || !m->timing);
+        printf("  %-24s %14.3f %14.3f %+7.1f%%%s\n", m->name, base, m->value, change * 100,
+               fails ? "  REGRESSION" : worse ? "  (other machine)" : "");
+        regressions += fails;
+    }
+    return regressions;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s MYSH [BASELINE.json] [RESULTS.json]\n", argv[0]);
+        return 2;
+    }
+    mysh = realpath(argv[1], NULL);
+    if (mysh == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+    const char *baseline = argc > 2 && argv[2][0] != '\0' ? argv[2] : NULL;
+    const char *results = argc > 3 ? argv[3] : "bench/results.json";
+
+    const char *dir = getenv("BENCH_DIR");
+    snprintf(workdir, sizeof(workdir), "%s", dir != NULL ? dir : "/tmp/mysh-bench");
+    mkdir(workdir, 0755);
+    describe_host();
+
+    printf("Benchmarking %s in %s on %s\n", mysh, workdir, host);
+    bench_batch();
+    bench_latency();
+    bench_read();
+    const char *sizes = getenv("BENCH_GLOB_SIZES");
+    char list[256];
+    snprintf(list, sizeof(list), "%s", sizes != NULL ? sizes : "10000 100000 1000000");
+    for (char *size = strtok(list, " ,"); size != NULL; size = strtok(NULL, " ,"))
+        bench_glob(atol(size));
+    bench_loop();
+    bench_serve();
+    bench_pipe();
+    bench_fds();
+
+    write_results(results);
+    printf("Results written to %s\n", results);
+    if (baseline != NULL && compare_baseline(baseline) > 0) {
+        printf("Performance regressed beyond the tolerance\n");
+        return 1;
+    }
+    return 0;
+}
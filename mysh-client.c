@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Client for mysh --serve SOCKET: runs a script, or one command line, in the server with
+// this process's stdin, stdout and stderr and working directory, and exits with its status.
+// Usage: mysh-client SOCKET script.sh
+//        mysh-client SOCKET -c COMMAND
+
+#define SERVE_CHUNK 65536 // Largest message the server accepts, as in mysh.c
+
+// Sends the script in messages of at most SERVE_CHUNK bytes
+int send_text(int sock, const char* text, size_t len) {
+    while (len > 0) {
+        size_t n = len < SERVE_CHUNK ? len : SERVE_CHUNK;
+        if (send(sock, text, n, MSG_NOSIGNAL) != (ssize_t)n)
+            return -1;
+        text += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends a script file chunk by chunk
+int send_file(int sock, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    char buf[SERVE_CHUNK];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (send_text(sock, buf, n) < 0)
+            break;
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3 && !(argc == 4 && strcmp(argv[2], "-c") == 0)) {
+        fprintf(stderr, "usage: %s SOCKET script.sh | %s SOCKET -c COMMAND\n", argv[0], argv[0]);
+        return 2;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mysh-client: socket path too long: %s\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(argv[1]);
+        return 2;
+    }
+
+    // The working directory, with stdin, stdout and stderr attached
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd");
+        return 2;
+    }
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {cwd, strlen(cwd)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg");
+        return 2;
+    }
+
+    int sent;
+    if (argc == 4) {
+        size_t len = strlen(argv[3]);
+        sent = send_text(sock, argv[3], len) == 0 && send_text(sock, "\n", 1) == 0 ? 0 : -1;
+    } else {
+        sent = send_file(sock, argv[2]);
+    }
+    if (sent < 0) {
+        perror(argv[2]);
+        return 2;
+    }
+    shutdown(sock, SHUT_WR);
+
+    // The server answers with the exit status once the script has run
+    int status;
+    ssize_t n;
+    while ((n = recv(sock, &status, sizeof(status), 0)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(status)) {
+        fprintf(stderr, "mysh-client: the server closed the connection\n");
+        return 2;
+    }
+    return status;
+}
@@ -1,54 +1,695 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <spawn.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
-#define MAX_COMMAND_LENGTH 10000
-#define MAX_TOKENS 1000
-#define MAX_TOKEN_LENGTH 1000
 #define BUFLENGTH 16
+#define ARENA_BLOCK_SIZE 65536
+#define HASH_BUCKETS 256
+#define SERVE_CHUNK 65536 // Largest message a mysh-client sends, see serve()
+#define SERVE_SPARES 4    // Copies of the server waiting for clients
+#define SERVE_COPIES 64   // Most copies of the server alive at once, serving or waiting
+#define HISTORY_DEFAULT_SIZE 1000000 // Lines of history kept when histsize is auto
+#define HISTORY_BLOCK 32             // History entries summarized by one search filter
+#define HISTORY_FILTER_WORDS 64      // 64-bit words per filter, one bit per trigram hash
+#define DIR_CACHE_SIZE 8             // Directories whose entries are kept for completion
+
+// Directories searched for executables when $PATH is not set
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"
 
-// Directory paths to search for executables
-#define DIR_PATHS {"/usr/local/bin", "/usr/bin", "/bin"}
+extern char **environ;
+
+// glibc 2.35 can hand the terminal to a spawned process group itself
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define SPAWN_HAS_TCSETPGRP
+#endif
 
 // Global int variable that keeps track of if the previous command failed or succeeded
 //Used for conditionals
 int currstatus = 1;
 
+// True when commands are typed at a terminal rather than read from a script
+bool interactive_mode = true;
+
+// Line currently being executed, used to describe background jobs
+const char *current_line = NULL;
+
+// Resources of the children reaped since the time builtin last reset it
+struct rusage child_usage;
+
+// Nanoseconds the current line spent being parsed, and its processes spent being started
+long long parse_ns = 0;
+long long spawn_ns = 0;
+
+// Signal that ended the last foreground process reaped, 0 if it exited
+int last_signal = 0;
+
+// Set when the shell started as the foreground process group of the terminal on stdin.
+// Pipelines then get the terminal while they run, so keyboard signals only reach them.
+bool terminal_owned = false;
+
 typedef struct {
     int fd;
     int pos;
     int len;
     char buf[BUFLENGTH];
+    char *map;       // Script mapped into memory when reading a regular file, else NULL
+    size_t map_len;  // Size of the mapped script
+    size_t map_pos;  // Offset of the next unread line in the mapping
+    char *line;      // Last line returned if it was allocated, freed on the next read
+    bool owns_map;   // The mapping belongs to the reader and is unmapped at the end
+    bool edit;       // Lines are typed at a terminal and read with the line editor
 } lines_t;
 
+// Stream the current line came from; here-document bodies are read from it
+lines_t *command_input = NULL;
+
+// Prompt printed before the line being read, redrawn by the line editor
+const char *current_prompt = NULL;
+
+// Keys the line editor reads as escape sequences
+enum { KEY_UP = 256, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE };
+
+// Line being edited at the terminal. Its buffers only grow, so editing a line allocates
+// nothing once they are large enough.
+typedef struct {
+    char *buf;                // The line
+    size_t len, pos, room;    // Its length, the cursor and the bytes allocated
+    char *out;                // Screen update being put together
+    size_t out_len, out_room;
+    char *pending;            // The new line, kept while older lines are browsed
+    size_t pending_room;
+    char *saved;              // The line as it was before a search
+    size_t saved_room;
+} editor_t;
+
+editor_t editor;
+
+// Command history. All entries share one buffer, each ending in a NUL. For reverse search,
+// every block of HISTORY_BLOCK entries has a filter with a bit set for each trigram in them,
+// so a search only looks inside the blocks that have all the trigrams of the query.
+typedef struct {
+    char *text;                                 // Entries, oldest first
+    size_t len, room;
+    size_t *start;                              // Offset of each entry in text
+    int count, capacity;
+    uint64_t (*filters)[HISTORY_FILTER_WORDS];  // One filter per block
+    int indexed;                                // Entries added to the filters so far
+    int filter_capacity;
+    int fd;                                     // History file, open for appending, or -1
+    bool loaded;                                // The file was read
+} history_t;
+
+history_t history;
+
+// Sorted names in a directory, for completion: the executables of a $PATH directory or
+// all entries of a directory, directories with a '/' appended. The list is read again
+// only when the directory's mtime changes.
+typedef struct {
+    char *dir;
+    struct timespec mtime;
+    ino_t ino;
+    bool scanned;
+    char **names;
+    int count;
+    char *text;        // Storage for the names
+    size_t len, room;
+} name_list_t;
+
+// Completion caches: the $PATH directories, and the directories listed last
+name_list_t *path_names = NULL;
+int npath_names = 0;
+char *completion_path = NULL; // $PATH the directories were taken from
+name_list_t dir_names[DIR_CACHE_SIZE];
+int dir_cache_next = 0;
+
+// Candidates of the current completion
+const char **candidates = NULL;
+int ncandidates = 0, candidates_room = 0;
+
+// Group of script lines run by one worker in parallel batch mode: a line and the
+// then/else lines that depend on it
+typedef struct {
+    char *text;   // The lines, each ending in a newline
+    size_t len;   // Bytes used in text
+    pid_t pid;    // Worker running the lines
+    int pidfd;    // Descriptor that becomes readable when the worker exits, or -1
+    int outfd;    // memfd holding the worker's stdout
+    int errfd;    // memfd holding the worker's stderr
+    bool done;    // The worker has been reaped
+    int status;   // Shell status after the last line
+} unit_t;
+
+// Block of memory handed out by an arena
+typedef struct arena_block {
+    struct arena_block *next;  // Previously filled block
+    size_t size;               // Usable bytes in data
+    size_t used;               // Bytes already handed out
+    char data[];
+} arena_block_t;
+
+// Bump allocator for memory that lives only as long as one command
+typedef struct {
+    arena_block_t *head;  // Block currently allocated from
+} arena_t;
+
+// Position in an arena saved by arena_mark, to free what was allocated after it
+typedef struct {
+    arena_block_t *block;  // Block that was current
+    size_t used;           // Bytes used in it
+    arena_block_t *older;  // Block after it; blocks adopted in between are freed too
+} arena_mark_t;
+
+// Tokens, expanded wildcards and other per-command strings, reset after each command
+arena_t command_arena;
+
+// Growable NULL-terminated array of words in the command arena, such as the words of a
+// line or the arguments a wildcard expands to; there is no limit on their number
+typedef struct {
+    char **items;  // The words, followed by NULL
+    int count;     // Words stored
+    int room;      // Entries allocated, including the terminating NULL
+} words_t;
+
+// Loops compiled from the current line, reset once it ran; function bodies, kept for good
+arena_t block_arena;
+arena_t function_arena;
+
+// Tunable setting changed with the setopt builtin. AUTO_VALUE lets the shell decide.
+#define AUTO_VALUE -1
+typedef struct {
+    const char *name;         // Name given to setopt
+    int *value;               // Current value
+    const char *description;  // Shown when the settings are listed
+} shell_option_t;
+
+// Number of threads walking directory trees for '**' wildcards
+int glob_threads = AUTO_VALUE;
+
+// Lines of command history kept in memory and in the history file
+int history_size = AUTO_VALUE;
+
+// Buffer size of the pipes between pipeline stages, 0 for the kernel's default
+int pipe_size = AUTO_VALUE;
+
+// Whether every pipe of a foreground pipeline is relayed and measured
+int pipe_stats = 0;
+
+// Megabytes of command output the cache builtin keeps on disk
+int cache_size = AUTO_VALUE;
+
+shell_option_t shell_options[] = {
+    {"cachesize", &cache_size, "megabytes of output kept by the cache builtin (auto: 1024)"},
+    {"globthreads", &glob_threads, "threads walking directories for '**' (auto: one per CPU)"},
+    {"histsize", &history_size, "lines of command history kept (auto: 1000000)"},
+    {"pipesize", &pipe_size, "bytes of buffer per pipeline pipe (auto: 1M in the foreground; 0: kernel default)"},
+    {"pipestats", &pipe_stats, "1 reports bytes and blocked time for each pipe of a pipeline"},
+    {NULL, NULL, NULL}
+};
+
+// Bytes moved per call by the cat and tee builtins
+#define COPY_CHUNK (1 << 20)
+
+// Pipe buffer of foreground pipelines when pipesize is auto, if the system allows it
+#define PIPE_AUTO_SIZE (1 << 20)
+
+// Megabytes kept by the cache builtin when cachesize is auto
+#define CACHE_DEFAULT_SIZE 1024
+
+// 128-bit FNV-1a, which names the cache entries and the outputs they point to
+typedef unsigned __int128 hash128_t;
+#define HASH128_BASIS (((hash128_t)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+#define HASH128_PRIME (((hash128_t)1 << 88) | 0x13b)
+
+// Counters of one pipe of a pipeline, kept in shared memory by the process relaying it
+typedef struct {
+    unsigned long long bytes;     // Bytes passed from the writer to the reader
+    long long writer_blocked_ns;  // Time the pipe was full, so that its writer had to wait
+    long long reader_blocked_ns;  // Time the pipe was empty while its reader waited for data
+} pipe_stats_t;
+
+// Steps of running a line that --trace times, and the names they are written under
+enum { TRACE_READ, TRACE_LEX, TRACE_PARSE, TRACE_GLOB, TRACE_LOOKUP, TRACE_SPAWN, TRACE_FORK, TRACE_WAIT,
+       TRACE_PHASES };
+const char *trace_phase_names[TRACE_PHASES] = {"read", "lex", "parse", "glob", "lookup", "spawn", "fork", "wait"};
+
+#define TRACE_RING 4096   // Events a process holds before writing them to the trace file
+#define TRACE_BUCKETS 48  // Power-of-two latency buckets per step, the last one up to 39 hours
+
+// One timed step
+typedef struct {
+    long long start_ns;
+    long long dur_ns;
+    long value;        // A pid, a number of matches or words, or whether a lookup was cached
+    int phase;
+    char detail[44];   // Start of the line, word, path or status involved
+} trace_event_t;
+
+// Latency histogram per step of --trace. It lives in a shared mapping made before any fork,
+// so every copy of the shell, parallel workers included, adds its steps to the one that the
+// original shell prints at exit.
+typedef struct {
+    unsigned long long histogram[TRACE_PHASES][TRACE_BUCKETS];
+    long long total_ns[TRACE_PHASES];
+    long long max_ns[TRACE_PHASES];
+    long long events;     // Events recorded by all copies
+} trace_stats_t;
+
+// State of --trace FILE. Every copy of the shell fills its own ring of events, written to
+// the file in whole lines once it is full and at exit; only the thread running commands
+// records, so no lock is taken on the ring, and the shared counters are added atomically.
+typedef struct {
+    int fd;               // Trace file, -1 while tracing is off
+    bool chrome;          // FILE.json is a Chrome trace, anything else gets JSON lines
+    pid_t pid;            // Process the ring belongs to
+    pid_t owner;          // The shell that prints the summary
+    long long origin_ns;  // Time 0 of the trace
+    trace_event_t *ring;
+    int count;            // Events waiting in the ring
+    trace_stats_t *stats; // Shared with every forked copy
+} trace_t;
+trace_t trace = {.fd = -1};
+
+// Whether steps are being timed; a single predictable test when they are not
+#define TRACING __builtin_expect(trace.fd >= 0, 0)
+
+// Operator tokens produced by the lexer. They are told apart from words by address,
+// so a quoted "|", "<" or ">" is always passed to the command as an ordinary argument.
+char op_pipe[] = "|";
+char op_input[] = "<";
+char op_output[] = ">";
+char op_background[] = "&";
+char op_heredoc[] = "<<";
+char op_heredoc_strip[] = "<<-";
+char op_herestring[] = "<<<";
+char op_here_text[] = "<<"; // Followed by the text of a here-document, once its body was read
+char op_assign[] = "=";     // Followed by NAME=VALUE, an assignment in front of the command
+
+// Kinds of statement in a compiled loop or function
+enum { NODE_COMMAND, NODE_FOR, NODE_WHILE, NODE_FUNCTION };
+
+// Statement of a compiled script. Commands keep the raw words from the lexer, so running one
+// again only substitutes variables and expands wildcards, without lexing the text again.
+typedef struct node {
+    int type;           // NODE_*
+    char **words;       // Command words, the for list or the while condition, NULL-terminated
+    char *name;         // Loop variable or function name
+    struct node *body;  // First statement of the loop or function body
+    struct node *next;  // Statement after this one
+    char *line;         // Source line, shown for jobs the statement starts
+} node_t;
+
+// Shell function defined with name() { ... }
+typedef struct function {
+    char *name;
+    node_t *body;
+    bool shell_state;       // The body changes shell state, so parallel batch mode calls it in order
+    struct function *next;  // Next function in the same bucket
+} function_t;
+
+// Defined functions, hashed by name
+function_t *functions[HASH_BUCKETS];
+int nfunctions = 0;
+
+// Shell variable, set with NAME=VALUE or by a for loop. Exported variables, including those
+// inherited from the environment, are also the environment of commands.
+typedef struct {
+    char *name;             // NULL for an empty slot
+    char *value;
+    size_t room;            // Bytes allocated for value, reused when it is set again
+    unsigned int hash;
+    bool exported;
+} variable_t;
+
+// Shell variables in an open-addressing table with linear probing. Its capacity is a power
+// of two and it is kept at most half full, so a lookup usually probes one or two slots.
+variable_t *variables = NULL;
+int variable_capacity = 0;
+int variable_count = 0;
+
+// environ is rebuilt from the exported variables only after the exported set changed
+bool environ_stale = false;
+char **shell_environ = NULL;  // The array built by the shell, NULL while environ is inherited
+
+// A command substitution ran while the current line was expanded; it set the status
+bool substituted = false;
+
+// Output of the last command substitution, reused by the next one
+char *captured = NULL;
+size_t captured_room = 0;
+int capture_memfd = -1; // Receives the output of builtins run for a substitution
+
+// Copy of the server running a client's script; processes it forks do not answer the client
+pid_t serving_pid = 0;
+int serving_conn = -1; // Connection of the client being served, answered at exit
+
+// A command changed variables, functions, jobs, options or the working directory, so the
+// copy of the server that ran it does not serve another client
+bool shell_changed = false;
+
+// What each slot of --serve's shared table holds
+enum { SLOT_FREE, SLOT_WAITING, SLOT_BUSY };
+
+// Arguments of the function being run ($0 is its name), NULL outside functions
+char **positional_args = NULL;
+int positional_count = 0;
+int function_depth = 0;
+
+// Loops being run, and how many of them a break or continue is leaving
+int loop_depth = 0;
+int loop_jump = 0;
+bool jump_continue = false;    // The last loop left by the jump starts its next pass instead
+bool function_return = false;  // return ran; the rest of the function is skipped
+
+// Redirections attached to a single command
+typedef struct {
+    char *input_file;   // File named after '<', or NULL
+    char *input_data;   // Text of a here-document or here-string, used instead of a file
+    char *output_file;  // File named after '>', or NULL
+} redirect_t;
+
+struct job;
+
+// A process of a job, watched through a pidfd so that exits are noticed without SIGCHLD
+typedef struct {
+    struct job *job;  // Job the process belongs to
+    pid_t pid;        // Process id, 0 once it has been reaped
+    int pidfd;        // Descriptor registered with job_epoll, or -1 if pidfds are unavailable
+} job_proc_t;
+
+// A pipeline running in the background, or one that was stopped from the keyboard
+typedef struct job {
+    int id;            // Number used as %id
+    pid_t pgid;        // Process group of the pipeline
+    job_proc_t *procs; // Its processes, in pipeline order
+    int nprocs;        // Number of processes
+    int running;       // Processes not reaped yet
+    int status;        // Shell status (1 success, 0 failure) of the last process
+    bool stopped;      // Suspended with Ctrl-Z and not continued since
+    char *command;     // Command line shown by jobs
+} job_t;
+
+// Table of jobs, oldest first, and the epoll instance their pidfds are registered with
+job_t **jobs = NULL;
+int njobs = 0;
+int jobs_capacity = 0;
+int job_epoll = -1;
+int unwatched_procs = 0; // Job processes that have no pidfd
+
+// Entry of the hashed executable lookup cache, maps a bare command name to its full path
+typedef struct hash_entry {
+    char *name;               // Bare command name as typed
+    char *path;               // Full path found by searching $PATH
+    int hits;                 // Number of times the cached path was used
+    struct hash_entry *next;  // Next entry in the same bucket
+} hash_entry_t;
+
+// Hash table of previously resolved commands and the $PATH value it was built from
+hash_entry_t *command_hash[HASH_BUCKETS];
+char *hashed_path_env = NULL;
+
 // Function prototypes
 void print_prompt();
 void fdinit(lines_t *L, int fd);
 char *read_command(lines_t *L); 
-void parse_command(char* command, char* tokens[]);
+char *read_input(lines_t *L);
+char *read_mapped_command(lines_t *L);
+void meminit(lines_t *L, char* text, size_t len);
+void print_continuation_prompt();
+char *edit_line(lines_t* L);
+int read_key();
+void editor_refresh(const char* prompt, const char* text, size_t len, size_t pos);
+void editor_reserve(size_t n);
+void editor_insert(const char* s, size_t n);
+void editor_delete(size_t from, size_t to);
+void editor_set(const char* text);
+void editor_out(const char* s, size_t n);
+int editor_search(const char* prompt);
+void editor_complete(const char* prompt, bool listed);
+void keep_copy(char** dst, size_t* room, const char* text, size_t n);
+size_t text_columns(const char* s, size_t n);
+size_t next_char(const char* s, size_t i, size_t len);
+size_t prev_char(const char* s, size_t i);
+int history_limit();
+const char *history_entry(int i);
+unsigned int trigram_bit(const char* p);
+void history_add(const char* line, bool save);
+void history_load();
+void history_index();
+int history_search(const char* query, int before);
+void refresh_names(name_list_t* l, bool executables);
+void add_candidate(const char* name);
+void add_matching_names(name_list_t* l, const char* prefix, size_t plen);
+void complete_command(const char* prefix, size_t plen);
+void complete_file(const char* word, size_t len, size_t* base);
+int compare_candidates(const void* a, const void* b);
+void run_line(const char* line);
+void run_text(char* text, size_t len);
+void append_text(char** text, size_t* len, size_t* room, const char* line);
+int heredoc_delimiters(const char* line, char* delims[], bool strip[], int max);
+int read_heredocs(char* raw[]);
+int is_heredoc_end(const char* line, const char* delimiter, bool strip_tabs);
+char *read_heredoc(const char* delimiter, bool strip_tabs);
+char *remove_quotes(const char* raw);
+int open_input_data(const char* text);
+void classify_line(const char* line, bool* continues, bool* barrier, int* depth);
+void flush_output(int memfd, int fd);
+int start_unit(unit_t* u);
+void wait_units(unit_t* window, int capacity, int head, int count);
+int retire_units(unit_t* window, int capacity, int* head, int count);
+void run_parallel(lines_t* L, int nworkers);
+int serve(const char* path);
+int count_waiting(const char* slots);
+void serve_client(int conn);
+void send_serve_status(int status, void* arg);
+int parse_command(char* raw[], words_t* tokens);
+int is_operator(const char* word);
+char *substitute_variables(const char* raw);
+const char *skip_substitution(const char* p);
+const char *capture_command(const char* text, size_t len, size_t* outlen);
+int runs_in_substitution(char* tokens[]);
+int split_fields(char* word, words_t* tokens);
+const char *variable_value(const char* name, size_t len, char* scratch);
+int block_kind(char* raw[]);
+node_t *compile_block(arena_t* arena, int kind, char* raw[], const char* line);
+node_t *compile_body(arena_t* arena, const char* opener, const char* closer, bool* ok);
+char **copy_words(arena_t* arena, char* raw[]);
+void run_words(char* words[], const char* line);
+void run_nodes(node_t* node);
+int loop_ended();
+unsigned int hash_name(const char* name);
+function_t *find_function(const char* name);
+void define_function(node_t* node);
+int nodes_change_state(node_t* node);
+int word_changes_state(const char* word);
+void call_function(function_t* f, char* tokens[]);
+unsigned int hash_variable(const char* name, size_t len);
+variable_t *find_variable(const char* name, size_t len);
+variable_t *define_variable(const char* name, size_t len);
+void set_variable(const char* name, const char* value);
+void store_value(variable_t* v, const char* value);
+void unset_variable(const char* name);
+const char *get_variable(const char* name);
+void import_environment();
+void update_environ();
+int is_assignment(const char* word);
+void assign_variable(const char* assignment, bool export);
+int lex_command(const char* line, words_t* raw);
+int expand_word(const char* raw, words_t* tokens);
+void words_init(words_t* w);
+void words_push(words_t* w, char* word);
+void *arena_alloc(arena_t* arena, size_t size);
+char *arena_strndup(arena_t* arena, const char* s, size_t len);
+void arena_reset(arena_t* arena);
+void arena_adopt(arena_t* dst, arena_t* src);
+arena_mark_t arena_mark(arena_t* arena);
+void arena_release(arena_t* arena, arena_mark_t mark);
 void execute_command(char* tokens[]);
-int check_wildcard(char* token, char* tokens[], int tokencount);
+int check_wildcard(char* token, words_t* tokens);
 void execute_builtin_command(char* tokens[]);
 void print_welcome_message();
 void print_goodbye_message();
 int check_slash(char* command);
-void check_redirection(char* tokens[]);
+int check_redirection(char* tokens[], int saved[2]);
+void restore_redirection(int saved[2]);
+void collect_redirection(char* tokens[], redirect_t* r);
+int open_redirection(redirect_t* r, int* infd, int* outfd);
+pid_t launch_command(const char* path, char* argv[], int infd, int outfd, pid_t pgid, bool foreground);
+pid_t launch_stage(char* argv[], int infd, int outfd, pid_t pgid, bool foreground);
+void execute_pipeline(char* tokens[], bool background);
+void size_pipe(int fd, bool background);
+pid_t start_meter(int in, int out[2], pid_t pgid, pipe_stats_t* stats);
+void meter_pipe(int in, int out, pipe_stats_t* stats);
+void report_pipe_stats(char** stages[], int nstages, pipe_stats_t* stats, long long real_ns);
+void enter_process_group(pid_t pgid, bool foreground);
+void reclaim_terminal();
+int is_builtin(const char* name);
+int parse_option_value(const char* text, int* value);
+int wait_foreground(pid_t pids[], int n, pid_t pgid);
+long long now_ns();
+int trace_open(const char* path);
+void trace_event(int phase, long long start_ns, const char* detail, long value);
+void trace_flush();
+void trace_child();
+void trace_wait(long long start_ns, pid_t pid, int status);
+void trace_finish();
+void format_duration(long long ns, char* buf, size_t size);
+void add_usage(struct rusage* total, const struct rusage* ru);
+void report_time(const char* command, long long real_ns, const struct rusage* ru, const char* output);
+hash128_t hash_bytes(hash128_t h, const void* data, size_t len);
+hash128_t hash_file_state(hash128_t h, const char* path);
+void hash_hex(hash128_t h, char hex[33]);
+const char *cache_dir();
+void execute_cached(char* tokens[]);
+void run_with_fds(char* tokens[], int infd, int outfd);
+void evict_cache(const char* dir);
+void raise_fd_limit();
+job_t *add_job(pid_t pgid, pid_t pids[], int n, bool stopped);
+void finish_proc(job_proc_t* proc, int status);
+int reap_jobs(int timeout);
+void remove_job(job_t* job);
+void print_job(job_t* job);
+void notify_jobs();
+job_t *find_job(const char* spec);
+void wait_job(job_t* job);
+int parse_signal(const char* name);
 void execute_full(char* tokens[]);
 int check_pipe(char* tokens[]);
-void preprocess_command(char* command);
+int search_path(const char* name, char* result, size_t size);
+const char* lookup_command(const char* name);
+void hash_flush();
+void hash_forget(const char* name);
+void builtin_cd(char* tokens[]);
+void builtin_pwd(char* tokens[]);
+void builtin_which(char* tokens[]);
+void builtin_hash(char* tokens[]);
+void builtin_setopt(char* tokens[]);
+void builtin_export(char* tokens[]);
+void builtin_unset(char* tokens[]);
+void builtin_jobs(char* tokens[]);
+void builtin_wait(char* tokens[]);
+void builtin_fg(char* tokens[]);
+void builtin_kill(char* tokens[]);
+void builtin_exit(char* tokens[]);
+void builtin_echo(char* tokens[]);
+void builtin_printf(char* tokens[]);
+void builtin_true(char* tokens[]);
+void builtin_false(char* tokens[]);
+void builtin_test(char* tokens[]);
+void builtin_cat(char* tokens[]);
+void builtin_tee(char* tokens[]);
+void builtin_break(char* tokens[]);
+void builtin_batch(char* tokens[]);
+int run_batch(const char* path, char* fixed[], int nfixed, char* items[], int njobs, long room);
+void builtin_continue(char* tokens[]);
+void builtin_return(char* tokens[]);
+void jump_loops(char* tokens[], bool next);
+int copy_builtin_handles(char* tokens[], int infd);
+int copy_fd(int infd, int outfd);
+
+// A command the shell runs itself
+typedef struct {
+    const char *name;
+    void (*run)(char* tokens[]);
+    bool shell_state;  // Changes the shell or its jobs, so parallel batch mode runs it in order
+    int (*handles)(char* tokens[], int infd); // If set, whether this call is handled or goes to the real command
+} builtin_t;
+
+// Builtins sorted by name for find_builtin's binary search
+const builtin_t builtins[] = {
+    {":", builtin_true, false, NULL},
+    {"[", builtin_test, false, NULL},
+    {"batch", builtin_batch, false, NULL},
+    {"break", builtin_break, false, NULL},
+    {"cat", builtin_cat, false, copy_builtin_handles},
+    {"cd", builtin_cd, true, NULL},
+    {"continue", builtin_continue, false, NULL},
+    {"echo", builtin_echo, false, NULL},
+    {"exit", builtin_exit, true, NULL},
+    {"export", builtin_export, true, NULL},
+    {"false", builtin_false, false, NULL},
+    {"fg", builtin_fg, true, NULL},
+    {"hash", builtin_hash, true, NULL},
+    {"jobs", builtin_jobs, true, NULL},
+    {"kill", builtin_kill, true, NULL},
+    {"printf", builtin_printf, false, NULL},
+    {"pwd", builtin_pwd, false, NULL},
+    {"return", builtin_return, false, NULL},
+    {"setopt", builtin_setopt, true, NULL},
+    {"tee", builtin_tee, false, copy_builtin_handles},
+    {"test", builtin_test, false, NULL},
+    {"true", builtin_true, false, NULL},
+    {"unset", builtin_unset, true, NULL},
+    {"wait", builtin_wait, true, NULL},
+    {"which", builtin_which, false, NULL},
+};
+const builtin_t *find_builtin(const char* name);
+const builtin_t *builtin_for(char* tokens[], int infd);
 
 
 int main(int argc, char* argv[]) {
-    bool interactive_mode = true;  // Default mode is interactive
     int filefd = STDIN_FILENO;     // Default file descriptor for input is standard input
+    int nworkers = 1;              // Script lines run at a time, set with -j N
+
+    import_environment();
+
+    // --trace FILE times the steps of every command, see trace_t
+    if (argc > 2 && strcmp(argv[1], "--trace") == 0) {
+        if (trace_open(argv[2]) != 0) {
+            perror(argv[2]);
+            return EXIT_FAILURE;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    // --serve SOCKET runs scripts sent by mysh-client instead of reading one
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+        return serve(argv[2]);
+
+    // -j N runs independent lines of a batch script in parallel
+    if (argc > 2 && strncmp(argv[1], "-j", 2) == 0) {
+        const char *value = argv[1][2] != '\0' ? argv[1] + 2 : argv[2];
+        if (parse_option_value(value, &nworkers) != 0 || nworkers == 0) {
+            fprintf(stderr, "mysh: invalid -j value: %s\n", value);
+            return EXIT_FAILURE;
+        }
+        if (nworkers == AUTO_VALUE)
+            nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        int shift = argv[1][2] != '\0' ? 1 : 2;
+        argv += shift;
+        argc -= shift;
+    }
 
     // Check if any arguments were passed to determine operation mode
     if (argc > 1) {
@@ -60,27 +701,47 @@ int main(int argc, char* argv[]) {
         // If the file extension is ".sh", switch to batch mode
         if (strcmp(lastthree, ".sh") == 0) {
             interactive_mode = false;
-            filefd = open(argv[1], O_RDONLY);  // Open the file for reading
+            filefd = open(argv[1], O_RDONLY | O_CLOEXEC);  // Open the file for reading
         }
     } else {
         // If no arguments, check if the input is from a terminal (interactive mode)
         interactive_mode = isatty(STDIN_FILENO);
     }
 
+    // Pipelines run in their own process groups; take the terminal back without being stopped
+    if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+        terminal_owned = true;
+        signal(SIGTTOU, SIG_IGN);
+    }
+
     // Initialize the input stream with the file descriptor
     lines_t inputstream;
     fdinit(&inputstream, filefd);
+    const char *term = get_variable("TERM");
+    inputstream.edit = interactive_mode && filefd == STDIN_FILENO && isatty(STDIN_FILENO) &&
+                       (term == NULL || strcmp(term, "dumb") != 0);
 
     // If in interactive mode, print a welcome message
     if (interactive_mode) {
         print_welcome_message();
     }
 
+    command_input = &inputstream;
+    if (!interactive_mode && nworkers > 1) {
+        run_parallel(&inputstream, nworkers);
+        return 0;
+    }
+
     // Main loop for reading and executing commands
     while (1) {
-        char command[MAX_COMMAND_LENGTH];
-        char* tokens[MAX_TOKENS];
- 
+        // Collect background jobs that finished, reporting them when interactive
+        if (njobs > 0) {
+            if (interactive_mode)
+                notify_jobs();
+            else
+                reap_jobs(0);
+        }
+
         // If in interactive mode, display a prompt
         if (interactive_mode) {
             print_prompt();
@@ -88,17 +749,12 @@ int main(int argc, char* argv[]) {
 
         // Read a command from the input stream
         char *line = read_command(&inputstream);
-        if (line) {
-            strcpy(command, line);  // Copy the read line into command
-        } else {
+        if (line == NULL) {
             break;  // Exit loop if no line is read (EOF or error)
         }
         
-        // Parse the command into tokens
-        parse_command(command, tokens);
-
-        // Execute the parsed command
-        execute_full(tokens);
+        // Parse the command into tokens and execute it
+        run_line(line);
     }
 
     // If in interactive mode, print a goodbye message before exiting
@@ -112,7 +768,14 @@ int main(int argc, char* argv[]) {
 // Function to print the shell prompt
 void print_prompt() {
     const char *prompt = "mysh> ";
-    write(dup(STDOUT_FILENO), prompt, strlen(prompt));  // Duplicate stdout and write prompt to it
+    current_prompt = prompt;
+    write(STDOUT_FILENO, prompt, strlen(prompt));
+}
+
+// Prints the prompt for a line that continues a command, such as a loop body
+void print_continuation_prompt() {
+    current_prompt = "> ";
+    write(STDOUT_FILENO, current_prompt, 2);
 }
 
 // Function to print the welcome message at the start
@@ -125,14 +788,86 @@ void print_goodbye_message() {
     printf("Exiting\n");
 }
 
-// Function to initialize a lines_t structure with a file descriptor
+// Function to initialize a lines_t structure with a file descriptor.
+// A regular file (a batch script) is mapped into memory so that its lines can be handed
+// out in place; pipes and terminals are read through the small buffer.
 void fdinit(lines_t *L, int fd) {
     L->fd = fd;   // Assign the file descriptor
     L->pos = 0;   // Initialize current position in buffer to 0
     L->len = 0;   // Initialize length of data in buffer to 0
+    L->map = NULL;
+    L->map_len = 0;
+    L->map_pos = 0;
+    L->line = NULL;
+    L->owns_map = true;
+    L->edit = false;
+
+    struct stat sbuf;
+    if (fd >= 0 && fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && sbuf.st_size > 0) {
+        // A private writable mapping lets newlines be replaced with terminators in place
+        char *map = mmap(NULL, sbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, sbuf.st_size, MADV_SEQUENTIAL);
+            L->map = map;
+            L->map_len = sbuf.st_size;
+        }
+    }
+}
+
+// Returns the next line of a mapped script without copying it, or NULL at the end
+char *read_mapped_command(lines_t *L) {
+    if (L->map_pos >= L->map_len) {
+        if (L->owns_map) {
+            munmap(L->map, L->map_len);
+            close(L->fd);
+        }
+        L->map = NULL;
+        L->fd = -1;
+        return NULL;
+    }
+
+    char *line = L->map + L->map_pos;
+    size_t remaining = L->map_len - L->map_pos;
+    char *newline = memchr(line, '\n', remaining);
+    if (newline == NULL) {
+        // The last line has no newline to overwrite, so it is the only one that gets copied
+        L->line = malloc(remaining + 1);
+        memcpy(L->line, line, remaining);
+        L->line[remaining] = '\0';
+        L->map_pos = L->map_len;
+        return L->line;
+    }
+    *newline = '\0';
+    L->map_pos += newline - line + 1;
+    return line;
+}
+
+// Initializes a lines_t that hands out the lines of text in place, like a mapped script.
+// The text is modified and must stay allocated while lines are read.
+void meminit(lines_t *L, char* text, size_t len) {
+    fdinit(L, -1);
+    L->map = text;
+    L->map_len = len;
+    L->owns_map = false;
 }
 
+// Reads the next line from the input stream. The returned line stays valid until the next call.
 char *read_command(lines_t *L) {
+    if (!TRACING)
+        return read_input(L);
+    long long start = now_ns();
+    char *line = read_input(L);
+    if (line != NULL)
+        trace_event(TRACE_READ, start, line, 0);
+    return line;
+}
+
+// Does the work of read_command
+char *read_input(lines_t *L) {
+    free(L->line); // The previous line is no longer needed
+    L->line = NULL;
+    if (L->edit) return edit_line(L);
+    if (L->map != NULL) return read_mapped_command(L);
     if (L->fd < 0) return NULL; // Check if file descriptor is valid
     char *line = NULL; // Pointer to the line being read
     int line_length = 0; // Length of the line
@@ -154,7 +889,7 @@ char *read_command(lines_t *L) {
             if (L->len < 1) { // If read fails or EOF is reached, close the file descriptor and return
                 close(L->fd);
                 L->fd = -1;
-                return line;
+                return L->line = line;
             }
             // Reset position and segment start for the new data
             L->pos = 0;
@@ -169,7 +904,7 @@ char *read_command(lines_t *L) {
                 memcpy(line + line_length, L->buf + segment_start, segment_length);
                 line[line_length + segment_length] = '\0';
                 L->pos++;
-                return line;
+                return L->line = line;
             }
             L->pos++;
         }
@@ -177,429 +912,5216 @@ char *read_command(lines_t *L) {
     return NULL; // Should never reach this point
 }
 
-void preprocess_command(char* command) {
-    int i = 0; // Index for iterating through the command
-    while (command[i] != '\0') { // Continue until the end of the string
-        if (command[i] == '>' || command[i] == '<' || command[i] == '|') {
-            // Add space before the token if necessary
-            if (i > 0 && command[i - 1] != ' ') {
-                int j = strlen(command);
-                while (j >= i) {
-                    command[j + 1] = command[j];
-                    j--;
-                }
-                command[i] = ' ';
-                i++;
-            }
-            // Add space after the token if necessary
-            if (command[i + 1] != ' ') {
-                int j = strlen(command);
-                while (j >= i + 1) {
-                    command[j + 1] = command[j];
-                    j--;
-                }
-                command[i + 1] = ' ';
-                i++;
-            }
-        }
-        i++;
-    }
-} 
+// Number of history lines kept, set with setopt histsize
+int history_limit() {
+    return history_size == AUTO_VALUE ? HISTORY_DEFAULT_SIZE : history_size > 0 ? history_size : 1;
+}
 
-// Parses a command string into an array of tokens for execution.
-void parse_command(char* command, char* tokens[]) {
-    char* token; // Pointer to the current token
-    int token_count = 0; // Number of tokens found
+// Returns the history entry i, oldest first
+const char *history_entry(int i) {
+    return history.text + history.start[i];
+}
 
-    preprocess_command(command); // Preprocess to handle special tokens
+// Hashes the three bytes at p to a bit of a history search filter
+unsigned int trigram_bit(const char* p) {
+    const unsigned char *u = (const unsigned char*)p;
+    return ((u[0] | u[1] << 8 | u[2] << 16) * 2654435761u) >> 20;
+}
 
-    // Tokenize the command string using spaces, tabs, and newlines as delimiters
-    token = strtok(command, " \t\n");
-    while (token != NULL && token_count < MAX_TOKENS - 1) {
-        // Handle wildcard expansion, if necessary
-        int x = 0;
-        if ((x = check_wildcard(token, tokens, token_count)) > 0)
-            token_count += x;
-        else { // Normal token processing
-            tokens[token_count] = malloc(strlen(token) + 1); // Allocate memory for the token
-            strcpy(tokens[token_count], token); // Copy the token
-            token_count++; // Increment token count
-        }
-        token = strtok(NULL, " \t\n"); // Continue tokenization
+// Adds a line to the history, unless it is blank or repeats the last entry. With save, it is
+// also appended to the history file. When the history holds a quarter more than histsize
+// entries, the oldest are dropped, so this only moves memory once in a while.
+void history_add(const char* line, bool save) {
+    size_t n = strlen(line);
+    if (strspn(line, " \t") == n || (history.count > 0 && strcmp(history_entry(history.count - 1), line) == 0))
+        return;
+    int limit = history_limit();
+    // Trimmed in batches once a quarter over the limit; with a limit below 4 that is one over,
+    // and drop stays below count so start[drop] is always an entry
+    if (history.count > limit && history.count >= limit + limit / 4) {
+        int drop = history.count - limit;
+        size_t offset = history.start[drop];
+        memmove(history.text, history.text + offset, history.len - offset);
+        history.len -= offset;
+        history.count -= drop;
+        for (int i = 0; i < history.count; i++)
+            history.start[i] = history.start[i + drop] - offset;
+        history.indexed = 0; // Blocks moved, the filters are rebuilt on the next search
     }
-    tokens[token_count] = NULL; // Null-terminate the tokens array
-}
+    if (history.len + n + 1 > history.room) {
+        history.room = (history.len + n + 1) * 2;
+        history.text = realloc(history.text, history.room);
+    }
+    if (history.count == history.capacity) {
+        history.capacity = history.capacity > 0 ? history.capacity * 2 : 256;
+        history.start = realloc(history.start, history.capacity * sizeof(size_t));
+    }
+    history.start[history.count++] = history.len;
+    memcpy(history.text + history.len, line, n + 1);
+    history.len += n + 1;
 
-// Determines if a command contains a slash '/', indicating a direct pathname.
-// Returns 1 if true, indicating a direct pathname.
-int check_slash(char* command) {
-    for (int i = 0; command[i] != '\0'; i++)
-        if (command[i] == '/')
-            return 1; // Slash found, indicating a direct pathname
-    return 0; // No slash found, not a direct pathname
+    if (save && history.fd >= 0) {
+        struct iovec iov[2] = {{(char*)line, n}, {"\n", 1}};
+        writev(history.fd, iov, 2);
+    }
 }
 
-// Executes a single command, considering redirections, conditionals, and whether the command is built-in or external.
-void execute_command(char* tokens[]) {
-    // Save current STDIN and STDOUT file descriptors to restore later after redirections
-    int original_stdout = dup(STDOUT_FILENO);
-    int original_stdin = dup(STDIN_FILENO);
+// Loads the history file ($MYSH_HISTFILE, or ~/.mysh_history) and keeps it open to append
+// the lines typed from now on. A file more than twice the size of the histsize lines kept
+// is rewritten with just those.
+void history_load() {
+    char path[PATH_MAX];
+    const char *file = get_variable("MYSH_HISTFILE"), *home = get_variable("HOME");
+    if (file != NULL)
+        snprintf(path, sizeof(path), "%s", file);
+    else if (home != NULL)
+        snprintf(path, sizeof(path), "%s/.mysh_history", home);
+    else
+        return;
+    history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat sbuf;
+    if (history.fd < 0 || fstat(history.fd, &sbuf) < 0 || sbuf.st_size == 0)
+        return;
+    char *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+    if (map == MAP_FAILED)
+        return;
 
-    // Handling conditional execution based on the outcome of the previous command
-    if (strcmp(tokens[0], "then") == 0) {
-        if (currstatus != 1) return; // Skip command if the previous command did not succeed
-        tokens++; // Move past the conditional token for execution
+    // Only the last histsize lines are kept, so count back from the end to find the first
+    size_t size = sbuf.st_size, first = 0;
+    size_t end = map[size - 1] == '\n' ? size - 1 : size;
+    int lines = 0, limit = history_limit();
+    for (size_t i = end; i > 0; i--)
+        if (map[i - 1] == '\n' && ++lines == limit) {
+            first = i;
+            break;
+        }
+    char *line = NULL;
+    size_t room = 0;
+    for (size_t p = first; p < size;) {
+        char *newline = memchr(map + p, '\n', size - p);
+        size_t n = newline != NULL ? (size_t)(newline - map) - p : size - p;
+        if (n + 1 > room) {
+            room = (n + 1) * 2;
+            line = realloc(line, room);
+        }
+        memcpy(line, map + p, n);
+        line[n] = '\0';
+        history_add(line, false);
+        p += n + 1;
     }
+    free(line);
 
-    if (strcmp(tokens[0], "else") == 0) {
-        if (currstatus != 0) return; // Skip command if the previous command succeeded
-        tokens++; // Move past the conditional token for execution
+    if (first > size / 2) { // More than half of the file is no longer used
+        char tmp[PATH_MAX + 8];
+        snprintf(tmp, sizeof(tmp), "%s.new", path);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0 && write(fd, map + first, size - first) == (ssize_t)(size - first) &&
+            rename(tmp, path) == 0) {
+            close(history.fd);
+            history.fd = fd;
+            fcntl(fd, F_SETFL, O_APPEND);
+        } else if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
     }
+    munmap(map, size);
+}
 
-    // Execute built-in commands directly without forking
-    if (strcmp(tokens[0], "cd") == 0 || strcmp(tokens[0], "pwd") == 0 || strcmp(tokens[0], "which") == 0 || strcmp(tokens[0], "exit") == 0) {
-        check_redirection(tokens); // Handle redirection if any before executing
-        execute_builtin_command(tokens); // Execute the built-in command
-    } else if (check_slash(tokens[0]) == 0) { // If not a direct pathname, search for the command in specified directories
-        char* dir_paths[] = DIR_PATHS; // Assuming DIR_PATHS is an array of directory paths
-        int found = 0; // Flag to check if command is found
-        for (int i = 0; dir_paths[i] != NULL && !found; i++) {
-            char path[MAX_COMMAND_LENGTH];
-            // Construct the full path of the command
-            strcpy(path, dir_paths[i]);
-            strcat(path, "/");
-            strcat(path, tokens[0]);
-            // Check if the command exists and is executable
-            if (access(path, X_OK) == 0) {
-                found = 1; // Command found
-                pid_t pid = fork(); // Fork a child process to execute the command
-                if (pid == 0) { // Child process
-                    check_redirection(tokens); // Handle redirection if any
-                    execv(path, tokens); // Execute the command
-                    perror("execv"); // Execv should not return, print an error if it does
-                    currstatus = 0;
-                    exit(EXIT_FAILURE);
-                } else if (pid > 0) { // Parent process waits for child to complete
-                    int status;
-                    waitpid(pid, &status, 0);
-                    currstatus = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
-                } else {
-                    perror("fork"); // Forking failed
-                    currstatus = 0;
-                }
-            }
-        }
-        if (!found)
-            printf("Command not found: %s\n", tokens[0]);
-    } else { // Command includes a slash '/', execute directly
-        pid_t pid = fork(); // Fork a child process to execute the command
-        if (pid == 0) { // Child process
-            check_redirection(tokens); // Handle redirection if any
-            execv(tokens[0], tokens); // Execute the command
-            perror("execv"); // Execv should not return, print an error if it does
-            currstatus = 0;
-            exit(EXIT_FAILURE);
-        } else if (pid > 0) { // Parent process waits for child to complete
-            int status;
-            waitpid(pid, &status, 0);
-            currstatus = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
-        } else {
-            perror("fork"); // Forking failed
-            currstatus = 0;
+// Adds the trigrams of the entries that are not in the search filters yet
+void history_index() {
+    int blocks = (history.count + HISTORY_BLOCK - 1) / HISTORY_BLOCK;
+    if (blocks > history.filter_capacity) {
+        history.filter_capacity = blocks * 2;
+        history.filters = realloc(history.filters, history.filter_capacity * sizeof(*history.filters));
+    }
+    for (; history.indexed < history.count; history.indexed++) {
+        int i = history.indexed;
+        if (i % HISTORY_BLOCK == 0)
+            memset(history.filters[i / HISTORY_BLOCK], 0, sizeof(*history.filters));
+        uint64_t *filter = history.filters[i / HISTORY_BLOCK];
+        const char *e = history_entry(i);
+        for (size_t k = 0; e[k] != '\0' && e[k + 1] != '\0' && e[k + 2] != '\0'; k++) {
+            unsigned int bit = trigram_bit(e + k);
+            filter[bit / 64] |= (uint64_t)1 << (bit % 64);
         }
     }
+}
+
+// Finds the most recent history entry before entry number before that contains query, and
+// returns its number, or -1. Blocks whose filter lacks a trigram of the query are skipped
+// without looking at their entries; queries shorter than a trigram scan the entries.
+int history_search(const char* query, int before) {
+    size_t qlen = strlen(query);
+    if (qlen == 0 || before <= 0)
+        return -1;
+    if (before > history.count)
+        before = history.count;
+    if (qlen < 3) {
+        for (int i = before - 1; i >= 0; i--)
+            if (strstr(history_entry(i), query) != NULL)
+                return i;
+        return -1;
+    }
 
-    // Restore the original STDIN and STDOUT file descriptors
-    dup2(original_stdout, STDOUT_FILENO);
-    dup2(original_stdin, STDIN_FILENO);
-    close(original_stdout);
-    close(original_stdin);
+    history_index();
+    uint64_t want[HISTORY_FILTER_WORDS] = {0};
+    for (size_t k = 0; k + 2 < qlen; k++) {
+        unsigned int bit = trigram_bit(query + k);
+        want[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+    for (int b = (before - 1) / HISTORY_BLOCK; b >= 0; b--) {
+        uint64_t *filter = history.filters[b];
+        int w = 0;
+        while (w < HISTORY_FILTER_WORDS && (filter[w] & want[w]) == want[w])
+            w++;
+        if (w < HISTORY_FILTER_WORDS)
+            continue;
+        int last = (b + 1) * HISTORY_BLOCK < before ? (b + 1) * HISTORY_BLOCK : before;
+        for (int i = last - 1; i >= b * HISTORY_BLOCK; i--)
+            if (strstr(history_entry(i), query) != NULL)
+                return i;
+    }
+    return -1;
 }
 
-// Expands wildcard patterns to matching file names, adding them to the tokens array.
-// Returns the count of matched files.
-int check_wildcard(char* token, char* tokens[], int tokencount) {
-    bool wildcardFound = false;
-    bool pathFound = false;
-    int matchCount = 0;
-    // Allocate memory for path and temp token
-    char *startingpath = malloc(strlen(token) + 1);
-    strcpy(startingpath, token);
-    int finalPathStart = 0;
-    
-    // Check if the token includes a path by looking for '/'
-    for (int i = 0; i < strlen(token); i++)
-        if (token[i] == '/' && i < (strlen(token) - 1)) {
-            finalPathStart = i + 1;
-            pathFound = true;
-        }
-    
-    // Isolate the path part of the token, if any
-    if (pathFound)
-        startingpath[finalPathStart - 1] = '\0';
-
-    // Isolate the part of the token after the last '/'
-    char *temptoken = malloc(strlen(token) + 1);
-    strcpy(temptoken, &token[finalPathStart]);
-    
-    // Find the location of the wildcard '*' if present
-    int wildcardLocation = 0;
-    for (int i = 0; i < strlen(temptoken); i++) {
-        if (temptoken[i] == '*') {
-            wildcardFound = true;
-            break;
-        }
-        wildcardLocation++;
+// Copies n bytes of text into a buffer that is only reallocated when it is too small
+void keep_copy(char** dst, size_t* room, const char* text, size_t n) {
+    if (n + 1 > *room) {
+        *room = (n + 1) * 2;
+        *dst = realloc(*dst, *room);
     }
+    memcpy(*dst, text, n);
+    (*dst)[n] = '\0';
+}
 
-    // If a wildcard is found, attempt to match files
-    if (wildcardFound) {
-        char* firsthalf = temptoken;
-        char* secondhalf = &temptoken[wildcardLocation + 1];
-        firsthalf[wildcardLocation] = '\0'; // Split the token into before and after '*'
+// Makes sure the line being edited has room for n more bytes
+void editor_reserve(size_t n) {
+    if (editor.len + n + 1 > editor.room) {
+        editor.room = (editor.len + n + 1) * 2;
+        editor.buf = realloc(editor.buf, editor.room);
+    }
+}
 
-        DIR *d;
-        struct dirent *dir;
-        // Open the directory (either specified or current)
-        if (pathFound && strlen(startingpath) > 0)
-            d = opendir(startingpath);
-        else
-            d = opendir(".");
+// Inserts n bytes at the cursor
+void editor_insert(const char* s, size_t n) {
+    editor_reserve(n);
+    memmove(editor.buf + editor.pos + n, editor.buf + editor.pos, editor.len - editor.pos + 1);
+    memcpy(editor.buf + editor.pos, s, n);
+    editor.len += n;
+    editor.pos += n;
+}
 
-        if (d) {
-            while ((dir = readdir(d))) {
-                char *currname = dir->d_name;
-                struct stat sbuf;
-                char* fullpath = malloc(strlen(startingpath) + strlen(currname) + 2);
-                
-                // Construct the full path to check its status
-                if (pathFound)
-                    sprintf(fullpath, "%s/%s", startingpath, currname);
-                else
-                    strcpy(fullpath, currname);
+// Deletes the bytes between from and to
+void editor_delete(size_t from, size_t to) {
+    memmove(editor.buf + from, editor.buf + to, editor.len - to + 1);
+    editor.len -= to - from;
+    editor.pos = from;
+}
 
-                if (stat(fullpath, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && currname[0] != '.') {
-                    bool matchCheck = true;
-                    // Check match for the first half of the token
-                    for (int i = 0; i < strlen(firsthalf) && matchCheck; i++)
-                        if (currname[i] != firsthalf[i])
-                            matchCheck = false;
+// Replaces the whole line, with the cursor at its end
+void editor_set(const char* text) {
+    editor.len = editor.pos = 0;
+    editor.buf[0] = '\0';
+    editor_insert(text, strlen(text));
+}
 
-                    // Check match for the second half of the token
-                    int currnameLen = strlen(currname), secondhalfLen = strlen(secondhalf);
-                    for (int i = 0; i < secondhalfLen && matchCheck; i++)
-                        if (currname[currnameLen - secondhalfLen + i] != secondhalf[i])
-                            matchCheck = false;
+// Number of terminal columns n bytes of UTF-8 text take
+size_t text_columns(const char* s, size_t n) {
+    size_t cols = 0;
+    for (size_t i = 0; i < n; i++)
+        cols += ((unsigned char)s[i] & 0xC0) != 0x80;
+    return cols;
+}
 
-                    // If a match is found, add it to the tokens
-                    if (matchCheck) {
-                        tokens[tokencount++] = fullpath; // Use pre-increment to ensure 'tokens[tokencount]' is not used before increment
-                        matchCount++;
-                    } else
-                        free(fullpath); // Free the memory if not a match
-                } else
-                    free(fullpath); // Free the memory if stat fails or not a regular file
-            }
-            closedir(d);
-        }
+// Moves from byte i of text to the start of the next or previous character
+size_t next_char(const char* s, size_t i, size_t len) {
+    for (i++; i < len && ((unsigned char)s[i] & 0xC0) == 0x80; i++)
+        ;
+    return i;
+}
+size_t prev_char(const char* s, size_t i) {
+    for (i--; i > 0 && ((unsigned char)s[i] & 0xC0) == 0x80; i--)
+        ;
+    return i;
+}
+
+// Appends bytes to the screen update
+void editor_out(const char* s, size_t n) {
+    if (editor.out_len + n > editor.out_room) {
+        editor.out_room = (editor.out_len + n) * 2;
+        editor.out = realloc(editor.out, editor.out_room);
     }
+    memcpy(editor.out + editor.out_len, s, n);
+    editor.out_len += n;
+}
 
-    // Free the temporary memory allocated
-    free(startingpath);
-    free(temptoken);
+// Redraws the row: prompt, then text with the cursor at pos. A line wider than the terminal
+// scrolls sideways to keep the cursor in view. The update is sent with one write.
+void editor_refresh(const char* prompt, const char* text, size_t len, size_t pos) {
+    struct winsize ws;
+    size_t cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t plen = text_columns(prompt, strlen(prompt));
+    size_t start = 0, end;
+    while (start < pos && plen + text_columns(text + start, pos - start) >= cols)
+        start = next_char(text, start, len);
+    size_t width = plen;
+    for (end = start; end < len && width + 1 < cols; width++)
+        end = next_char(text, end, len);
 
-    return matchCount;
+    char move[32];
+    editor.out_len = 0;
+    editor_out("\r", 1);
+    editor_out(prompt, strlen(prompt));
+    editor_out(text + start, end - start);
+    editor_out("\x1b[K\r", 4);
+    size_t col = plen + text_columns(text + start, pos - start);
+    if (col > 0)
+        editor_out(move, snprintf(move, sizeof(move), "\x1b[%zuC", col));
+    write(STDOUT_FILENO, editor.out, editor.out_len);
 }
 
-// Frees all dynamically allocated tokens in an array to avoid memory leaks.
-void free_tokens(char* tokens[]) {
-    for (int i = 0; tokens[i] != NULL && i < MAX_TOKENS - 1; i++) {
-        free(tokens[i]);
-        tokens[i] = NULL; // Ensure the pointer is set to NULL after freeing
+// Reads one key; escape sequences for arrows, Home, End and Delete become KEY_* values
+int read_key() {
+    unsigned char c, seq[3];
+    if (read(STDIN_FILENO, &c, 1) != 1)
+        return -1;
+    if (c != '\x1b')
+        return c;
+    if (read(STDIN_FILENO, seq, 1) != 1 || read(STDIN_FILENO, seq + 1, 1) != 1)
+        return '\x1b';
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, seq + 2, 1) != 1 || seq[2] != '~')
+            return '\x1b';
+        return seq[1] == '3' ? KEY_DELETE : seq[1] == '1' || seq[1] == '7' ? KEY_HOME :
+               seq[1] == '4' || seq[1] == '8' ? KEY_END : '\x1b';
+    }
+    switch (seq[1]) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
     }
+    return '\x1b';
 }
 
-// Execute built-in shell commands
-void execute_builtin_command(char* tokens[]) {
-    // Change directory with 'cd'
-    if (strcmp(tokens[0], "cd") == 0) {
-        if (tokens[1] != NULL) {
-            if (chdir(tokens[1]) != 0) {
-                perror("cd"); // Print error if change directory fails
-                currstatus = 0;
-            } else
-                currstatus = 1;
-        } else {
-            fprintf(stderr, "cd: missing argument\n"); // No directory specified
-            currstatus = 0;
-        }
-    } 
-    // Print the current working directory with 'pwd'
-    else if (strcmp(tokens[0], "pwd") == 0) {
-        char cwd[1024]; // Buffer for the current working directory
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("%s\n", cwd); // Print the current directory
-            currstatus = 1;
+// Reverse incremental search started with Ctrl-R. Typing extends the query, Ctrl-R finds
+// an older match, Backspace shortens the query; Enter runs the match, Ctrl-G or Ctrl-C
+// give the line back as it was, and any other key keeps the match for editing.
+// Returns the key that ended the search, to be handled by the editor.
+int editor_search(const char* prompt) {
+    char query[256], shown[300];
+    size_t qlen = 0;
+    query[0] = '\0';
+    int match = history.count;
+    keep_copy(&editor.saved, &editor.saved_room, editor.buf, editor.len);
+    while (1) {
+        const char *text = match < history.count ? history_entry(match) : "";
+        const char *found = qlen > 0 ? strstr(text, query) : NULL;
+        snprintf(shown, sizeof(shown), "(reverse-i-search)`%s': ", query);
+        editor_refresh(shown, text, strlen(text), found != NULL ? (size_t)(found - text) : 0);
+
+        int key = read_key();
+        int from = history.count;
+        if (key == 18) { // Ctrl-R: the next older match
+            from = match;
+        } else if ((key == 127 || key == 8) && qlen > 0) {
+            query[--qlen] = '\0';
+        } else if (key >= 32 && key < 256 && key != 127 && qlen + 1 < sizeof(query)) {
+            query[qlen++] = key;
+            query[qlen] = '\0';
+            from = match < history.count ? match + 1 : match; // The current match may still fit
+        } else if (key == 7 || key == 3 || key < 0) { // Ctrl-G, Ctrl-C: cancel
+            editor_set(editor.saved);
+            editor_refresh(prompt, editor.buf, editor.len, editor.pos);
+            return key < 0 ? key : 0;
         } else {
-            perror("pwd"); // Print error if getting current directory fails
-            currstatus = 0;
+            if (match < history.count)
+                editor_set(history_entry(match));
+            editor_refresh(prompt, editor.buf, editor.len, editor.pos);
+            return key;
         }
-    } 
-    // Check if a command exists in PATH with 'which'
-    else if (strcmp(tokens[0], "which") == 0) {
-        if (tokens[1] == NULL || tokens[2] != NULL || 
-            strcmp(tokens[1], "cd") == 0 || strcmp(tokens[1], "pwd") == 0 ||
-            strcmp(tokens[1], "which") == 0 || strcmp(tokens[1], "exit") == 0) {
-            fprintf(stderr, "which: incorrect arguments\n");
-            currstatus = 0;
-        } else {
-            char *path_env = getenv("PATH");
-            char *path_env_copy = malloc(strlen(path_env) + 1);
-            strcpy(path_env_copy, path_env);
-            char *path = strtok(path_env_copy, ":");
-
-            while (path != NULL) {
-                char cmd_path[1024]; // Buffer for command path
-                sprintf(cmd_path, "%s/%s", path, tokens[1]); // Construct command path
-                
-                if (access(cmd_path, X_OK) == 0) {
-                    printf("%s\n", cmd_path); // Command found in PATH
-                    currstatus = 1;
-                    free(path_env_copy);
-                    return;
-                }
+        int found_at = history_search(query, from);
+        if (found_at >= 0)
+            match = found_at;
+        else if (key != 18 && qlen == 0)
+            match = history.count;
+        else
+            write(STDOUT_FILENO, "\a", 1);
+    }
+}
 
-                path = strtok(NULL, ":"); // Continue searching in PATH
-            }
-            fprintf(stderr, "which: no command found in PATH\n");
-            currstatus = 0;
-            free(path_env_copy);
+// Rescans a directory into a sorted name list if it changed since it was last scanned.
+// With executables, only files that can be run are listed; otherwise every entry is,
+// directories with a '/' appended.
+void refresh_names(name_list_t* l, bool executables) {
+    struct stat sbuf;
+    if (stat(l->dir[0] != '\0' ? l->dir : ".", &sbuf) != 0) {
+        l->count = 0;
+        l->scanned = false;
+        return;
+    }
+    if (l->scanned && sbuf.st_mtim.tv_sec == l->mtime.tv_sec && sbuf.st_mtim.tv_nsec == l->mtime.tv_nsec &&
+        sbuf.st_ino == l->ino)
+        return;
+    l->mtime = sbuf.st_mtim;
+    l->ino = sbuf.st_ino;
+    l->scanned = true;
+    l->count = 0;
+    l->len = 0;
+    DIR *d = opendir(l->dir[0] != '\0' ? l->dir : ".");
+    if (d == NULL)
+        return;
+    size_t *offsets = NULL;
+    int capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (executables && (is_dir || faccessat(dirfd(d), name, X_OK, 0) != 0))
+            continue;
+        size_t n = strlen(name) + (is_dir && !executables);
+        if (l->len + n + 1 > l->room) {
+            l->room = (l->len + n + 1) * 2;
+            l->text = realloc(l->text, l->room);
         }
-    } 
-    // Exit the shell with 'exit'
-    else if (strcmp(tokens[0], "exit") == 0) {
-        printf("Exiting mysh\n");
-        free_tokens(tokens); // Clean up before exiting
-        exit(EXIT_SUCCESS);
+        if (l->count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            offsets = realloc(offsets, capacity * sizeof(size_t));
+        }
+        offsets[l->count++] = l->len;
+        strcpy(l->text + l->len, name);
+        if (is_dir && !executables)
+            strcpy(l->text + l->len + n - 1, "/");
+        l->len += n + 1;
     }
+    closedir(d);
+    l->names = realloc(l->names, (l->count + 1) * sizeof(char*));
+    for (int i = 0; i < l->count; i++)
+        l->names[i] = l->text + offsets[i];
+    free(offsets);
+    qsort(l->names, l->count, sizeof(char*), compare_candidates);
 }
 
-// Checks for and performs input/output redirection
-void check_redirection(char *tokens[]) {
-    int input_index = -1, output_index = -1; // Indices for redirection symbols
-    char *input_file = NULL, *output_file = NULL;
-
-    // Loop through tokens to find redirection symbols and files
-    for (int i = 0; tokens[i] != NULL; i++) {
-        if (strcmp(tokens[i], "<") == 0) { // Input redirection
-            input_file = tokens[i + 1];
-            input_index = i;
-        } else if (strcmp(tokens[i], ">") == 0) { // Output redirection
-            output_file = tokens[i + 1];
-            output_index = i;
-        }
+// Adds a completion candidate
+void add_candidate(const char* name) {
+    if (ncandidates == candidates_room) {
+        candidates_room = candidates_room > 0 ? candidates_room * 2 : 256;
+        candidates = realloc(candidates, candidates_room * sizeof(char*));
     }
+    candidates[ncandidates++] = name;
+}
 
-    // Perform input redirection if needed
-    if (input_file != NULL) {
-        int fd = open(input_file, O_RDONLY);
-        if (fd < 0) {
-            perror("open input file");
-            exit(EXIT_FAILURE);
-        }
-        dup2(fd, STDIN_FILENO);
-        close(fd);
-        tokens[input_index] = tokens[input_index + 1] = NULL; // Remove redirection symbols and files from tokens
+// Adds the names of a sorted list that start with prefix, found by binary search
+void add_matching_names(name_list_t* l, const char* prefix, size_t plen) {
+    int lo = 0, hi = l->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strncmp(l->names[mid], prefix, plen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    for (int i = lo; i < l->count && strncmp(l->names[i], prefix, plen) == 0; i++)
+        if (prefix[0] == '.' || l->names[i][0] != '.')
+            add_candidate(l->names[i]);
+}
 
-    // Perform output redirection if needed
-    if (output_file != NULL) {
-        int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0640);
-        if (fd < 0) {
-            perror("open output file");
-            exit(EXIT_FAILURE);
+// Collects the commands starting with prefix: builtins, functions and the executables in
+// $PATH. The $PATH directories are cached and only those whose mtime changed are read again.
+void complete_command(const char* prefix, size_t plen) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        if (strncmp(builtins[i].name, prefix, plen) == 0)
+            add_candidate(builtins[i].name);
+    for (int b = 0; nfunctions > 0 && b < HASH_BUCKETS; b++)
+        for (function_t *f = functions[b]; f != NULL; f = f->next)
+            if (strncmp(f->name, prefix, plen) == 0)
+                add_candidate(f->name);
+
+    const char *path_env = get_variable("PATH");
+    if (path_env == NULL)
+        path_env = DEFAULT_PATH;
+    if (completion_path == NULL || strcmp(completion_path, path_env) != 0) {
+        for (int i = 0; i < npath_names; i++) {
+            free(path_names[i].dir);
+            free(path_names[i].text);
+            free(path_names[i].names);
+        }
+        free(completion_path);
+        completion_path = strdup(path_env);
+        npath_names = 1;
+        for (const char *p = path_env; *p != '\0'; p++)
+            npath_names += *p == ':';
+        path_names = realloc(path_names, npath_names * sizeof(name_list_t));
+        memset(path_names, 0, npath_names * sizeof(name_list_t));
+        const char *p = path_env;
+        for (int i = 0; i < npath_names; i++) {
+            size_t n = strcspn(p, ":");
+            path_names[i].dir = strndup(p, n);
+            p += n + (p[n] == ':');
         }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-        tokens[output_index] = tokens[output_index + 1] = NULL; // Remove redirection symbols and files from tokens
+    }
+    for (int i = 0; i < npath_names; i++) {
+        refresh_names(&path_names[i], true);
+        add_matching_names(&path_names[i], prefix, plen);
     }
 }
 
-//check if pipe exists in the command
-//returns 1 if it does
-int check_pipe(char* tokens[]) {
-    int i = 0;
-    int state = 0;
-    while (tokens[i] != NULL) {
-        if (strcmp(tokens[i], "|") == 0) {
-            state = 1;
-            break;
-        }
-        i++;
+// Collects the entries of the word's directory that start with its last component. The
+// last DIR_CACHE_SIZE directories listed are cached and read again only when they change.
+void complete_file(const char* word, size_t len, size_t* base) {
+    const char *slash = memrchr(word, '/', len);
+    *base = slash != NULL ? (size_t)(slash - word) + 1 : 0;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash == word ? 1 : *base > 0 ? *base - 1 : 0), word);
+    name_list_t *l = NULL;
+    for (int i = 0; i < DIR_CACHE_SIZE && l == NULL; i++)
+        if (dir_names[i].dir != NULL && strcmp(dir_names[i].dir, dir) == 0)
+            l = &dir_names[i];
+    if (l == NULL) {
+        l = &dir_names[dir_cache_next];
+        dir_cache_next = (dir_cache_next + 1) % DIR_CACHE_SIZE;
+        free(l->dir);
+        l->dir = strdup(dir);
+        l->scanned = false;
     }
-    return state;
+    refresh_names(l, false);
+    add_matching_names(l, word + *base, len - *base);
 }
 
-// Executes the full command with consideration for piping.
-void execute_full(char* tokens[]) {
-    // Save the original stdout and stdin file descriptors
-    int original_stdout = dup(STDOUT_FILENO);
-    int original_stdin = dup(STDIN_FILENO);
+// Orders completion candidates for qsort
+int compare_candidates(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
 
-    if (check_pipe(tokens) == 0) {
-        // No pipe found, execute command normally
-        execute_command(tokens);
-    } else {
-        // Find the index of the pipe symbol in the tokens array
-        int pipe_index = 0;
-        while (tokens[pipe_index] != NULL) {
-            if (strcmp(tokens[pipe_index], "|") == 0) {
-                break; // Pipe symbol found
-            }
-            pipe_index++;
-        }
+// Completes the word before the cursor. A word in command position is completed from the
+// commands, any other word from file names. A single candidate is inserted whole, several
+// are reduced to their common prefix, and a second Tab lists them.
+void editor_complete(const char* prompt, bool listed) {
+    size_t start = editor.pos;
+    while (start > 0 && !strchr(" \t|<>&", editor.buf[start - 1]))
+        start--;
+    size_t before = start;
+    while (before > 0 && (editor.buf[before - 1] == ' ' || editor.buf[before - 1] == '\t'))
+        before--;
+    bool command = before == 0 || strchr("|&", editor.buf[before - 1]) != NULL;
+    if (!command) { // then, else, time and cache are followed by a command too
+        size_t w = before;
+        while (w > 0 && editor.buf[w - 1] != ' ' && editor.buf[w - 1] != '\t')
+            w--;
+        size_t n = before - w;
+        command = (n == 4 && (strncmp(editor.buf + w, "then", 4) == 0 || strncmp(editor.buf + w, "else", 4) == 0 ||
+                              strncmp(editor.buf + w, "time", 4) == 0)) ||
+                  (n == 5 && (strncmp(editor.buf + w, "batch", 5) == 0 || strncmp(editor.buf + w, "cache", 5) == 0));
+    }
 
-        int p[2]; // Array to hold pipe file descriptors
-        if (pipe(p) == -1) { // Attempt to create a pipe
-            perror("pipe");
-            exit(1);
-        }
+    char word[PATH_MAX];
+    size_t len = editor.pos - start, base = 0;
+    if (len >= sizeof(word))
+        return;
+    memcpy(word, editor.buf + start, len);
+    word[len] = '\0';
+    ncandidates = 0;
+    if (command && strchr(word, '/') == NULL)
+        complete_command(word, len);
+    else
+        complete_file(word, len, &base);
+    if (ncandidates == 0) {
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
 
-        pid_t pid1 = fork(); // Fork the first child process
-        if (pid1 == -1) {
-            perror("fork");
-            exit(1);
-        } else if (pid1 == 0) { // Child 1: Executes the command before the pipe
-            close(p[0]); // Close the read end of the pipe
-            dup2(p[1], STDOUT_FILENO); // Redirect stdout to the write end of the pipe
-            close(p[1]); // Close the write end of the pipe
-            tokens[pipe_index] = NULL; // Nullify the pipe symbol for execution
-            execute_command(tokens); // Execute the first part of the piped command
-            exit(0);
-        } else {
-            // Fork the second child process to handle the command after the pipe
-            pid_t pid2 = fork();
-            if (pid2 == -1) {
-                perror("fork");
-                exit(1);
-            } else if (pid2 == 0) { // Child 2: Executes the command after the pipe
-                close(p[1]); // Close the write end of the pipe
-                dup2(p[0], STDIN_FILENO); // Redirect stdin to the read end of the pipe
-                close(p[0]); // Close the read end of the pipe
-                execute_command(tokens + pipe_index + 1); // Execute the second part of the piped command
-                exit(0);
-            } else {
-                // Parent process: Waits for both child processes to complete
-                close(p[0]);
-                close(p[1]);
-                wait(NULL); // Wait for the first child
-                wait(NULL); // Wait for the second child
-            }
+    // A command found in several places is offered once
+    qsort(candidates, ncandidates, sizeof(char*), compare_candidates);
+    int unique = 1;
+    for (int i = 1; i < ncandidates; i++)
+        if (strcmp(candidates[i], candidates[unique - 1]) != 0)
+            candidates[unique++] = candidates[i];
+    ncandidates = unique;
+
+    size_t have = len - base, common = strlen(candidates[0]);
+    for (int i = 1; i < ncandidates; i++) {
+        size_t k = 0;
+        while (k < common && candidates[i][k] == candidates[0][k])
+            k++;
+        common = k;
+    }
+    if (common > have)
+        editor_insert(candidates[0] + have, common - have);
+    if (ncandidates == 1 && candidates[0][common - 1] != '/')
+        editor_insert(" ", 1);
+    if (ncandidates > 1 && common == have) {
+        if (!listed) {
+            write(STDOUT_FILENO, "\a", 1);
+            return;
         }
+        // List them in columns below the line, then draw the line again
+        struct winsize ws;
+        size_t cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+        size_t width = 0;
+        for (int i = 0; i < ncandidates; i++)
+            if (strlen(candidates[i]) > width)
+                width = strlen(candidates[i]);
+        width += 2;
+        size_t per_row = cols / width > 0 ? cols / width : 1;
+        editor.out_len = 0;
+        editor_out("\r\n", 2);
+        for (int i = 0; i < ncandidates; i++) {
+            size_t n = strlen(candidates[i]);
+            editor_out(candidates[i], n);
+            if ((i + 1) % per_row == 0 || i == ncandidates - 1)
+                editor_out("\r\n", 2);
+            else
+                for (; n < width; n++)
+                    editor_out(" ", 1);
+        }
+        write(STDOUT_FILENO, editor.out, editor.out_len);
+    }
+    editor_refresh(prompt, editor.buf, editor.len, editor.pos);
+}
+
+// Reads a line from the terminal with editing, history and completion, the prompt having
+// been printed already. Returns NULL at end of input (Ctrl-D on an empty line). The terminal
+// is in raw mode only while the line is edited, so commands get it as it was.
+char *edit_line(lines_t* L) {
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved) != 0) {
+        L->edit = false; // Not a terminal after all; read it like a pipe
+        return read_command(L);
     }
-    // Restore the original stdout and stdin file descriptors
-    dup2(original_stdout, STDOUT_FILENO);
-    dup2(original_stdin, STDIN_FILENO);
-    close(original_stdout);
-    close(original_stdin);
-}
\ No newline at end of file
+    if (!history.loaded) {
+        history.loaded = true;
+        history.fd = -1;
+        history_load();
+    }
+    raw = saved;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN); // Ctrl-C only clears the line
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    const char *prompt = current_prompt != NULL ? current_prompt : "";
+    editor_reserve(0);
+    editor.len = editor.pos = 0;
+    editor.buf[0] = '\0';
+    int browsing = history.count; // History entry shown, history.count for the new line
+    bool eof = false, tabbed = false;
+    int key = read_key();
+    while (1) {
+        bool tab = false;
+        if (key == 18) {
+            key = editor_search(prompt);
+            if (key != 0)
+                continue; // The key that ended the search is handled as usual
+        } else if (key == '\r' || key == '\n') {
+            break;
+        } else if (key < 0 || (key == 4 && editor.len == 0)) {
+            eof = true;
+            break;
+        } else if (key == 3) { // Ctrl-C
+            write(STDOUT_FILENO, "^C\r\n", 4);
+            editor.len = editor.pos = 0;
+            editor.buf[0] = '\0';
+            browsing = history.count;
+        } else if (key == 9) {
+            editor_complete(prompt, tabbed);
+            tab = true;
+        } else if ((key == 127 || key == 8) && editor.pos > 0) {
+            editor_delete(prev_char(editor.buf, editor.pos), editor.pos);
+        } else if ((key == 4 || key == KEY_DELETE) && editor.pos < editor.len) {
+            size_t pos = editor.pos;
+            editor_delete(pos, next_char(editor.buf, pos, editor.len));
+        } else if ((key == 2 || key == KEY_LEFT) && editor.pos > 0) {
+            editor.pos = prev_char(editor.buf, editor.pos);
+        } else if ((key == 6 || key == KEY_RIGHT) && editor.pos < editor.len) {
+            editor.pos = next_char(editor.buf, editor.pos, editor.len);
+        } else if (key == 1 || key == KEY_HOME) {
+            editor.pos = 0;
+        } else if (key == 5 || key == KEY_END) {
+            editor.pos = editor.len;
+        } else if (key == 11) { // Ctrl-K
+            editor.len = editor.pos;
+            editor.buf[editor.len] = '\0';
+        } else if (key == 21) { // Ctrl-U
+            editor_delete(0, editor.pos);
+        } else if (key == 23) { // Ctrl-W
+            size_t from = editor.pos;
+            while (from > 0 && editor.buf[from - 1] == ' ')
+                from--;
+            while (from > 0 && editor.buf[from - 1] != ' ')
+                from--;
+            editor_delete(from, editor.pos);
+        } else if (key == 12) { // Ctrl-L
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        } else if ((key == 16 || key == KEY_UP) && browsing > 0) {
+            if (browsing == history.count) // Keep the new line to come back to it
+                keep_copy(&editor.pending, &editor.pending_room, editor.buf, editor.len);
+            editor_set(history_entry(--browsing));
+        } else if ((key == 14 || key == KEY_DOWN) && browsing < history.count) {
+            browsing++;
+            editor_set(browsing < history.count ? history_entry(browsing) : editor.pending);
+        } else if (key >= 32 && key < 256 && key != 127) {
+            char c = key;
+            editor_insert(&c, 1);
+        }
+        tabbed = tab;
+        if (!tab)
+            editor_refresh(prompt, editor.buf, editor.len, editor.pos);
+        key = read_key();
+    }
+    write(STDOUT_FILENO, "\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    if (eof)
+        return NULL;
+
+    history_add(editor.buf, true);
+    L->line = strndup(editor.buf, editor.len); // One copy per line, freed by read_command
+    return L->line;
+}
+
+// Parses and executes one line of input, then releases what it allocated. A line that starts
+// a loop or a function is compiled together with the lines of its body and then run.
+void run_line(const char* line) {
+    words_t words, tokens;
+    current_line = line;
+    long long start = now_ns();
+    int count = lex_command(line, &words);
+    if (TRACING)
+        trace_event(TRACE_LEX, start, line, count);
+    char **raw = words.items;
+    int kind = count > 0 ? block_kind(raw) : NODE_COMMAND;
+    if (kind != NODE_COMMAND) {
+        node_t *block = compile_block(&block_arena, kind, raw, line);
+        if (block != NULL)
+            run_nodes(block);
+        else
+            currstatus = 0;
+        arena_reset(&block_arena);
+    } else {
+        int parsed = count < 0 || read_heredocs(raw) < 0 ? -1 : parse_command(raw, &tokens);
+        parse_ns = now_ns() - start;
+        if (parsed == 0)
+            execute_full(tokens.items);
+        else
+            currstatus = 0;
+    }
+
+    // Everything the command allocated goes away at once
+    arena_reset(&command_arena);
+}
+
+// Runs lines held in memory, one unit of a parallel script, as if they came from the script
+void run_text(char* text, size_t len) {
+    lines_t L;
+    meminit(&L, text, len);
+    lines_t *saved = command_input;
+    command_input = &L;
+    char *line;
+    while ((line = read_command(&L)) != NULL)
+        run_line(line);
+    command_input = saved;
+}
+
+// Appends a line and a newline to a growing buffer
+void append_text(char** text, size_t* len, size_t* room, const char* line) {
+    size_t n = strlen(line);
+    if (*len + n + 1 > *room) {
+        *room = (*len + n + 1) * 2;
+        *text = realloc(*text, *room);
+    }
+    memcpy(*text + *len, line, n);
+    (*text)[*len + n] = '\n';
+    *len += n + 1;
+}
+
+// Looks at the words of a script line for parallel mode. A line continues the previous unit
+// when it is blank or starts with then/else, since it depends on the status before it. A
+// barrier changes shell state or jobs and must run in the shell after everything before it;
+// that includes defining a function, so that later workers inherit it. depth is set to 1
+// for a line that opens a loop or function body, -1 for one that may close it, else 0.
+void classify_line(const char* line, bool* continues, bool* barrier, int* depth) {
+    words_t words;
+    int count = lex_command(line, &words);
+    char **raw = words.items;
+    *continues = count == 0 || (count > 0 && (strcmp(raw[0], "then") == 0 || strcmp(raw[0], "else") == 0));
+    *barrier = false;
+    *depth = 0;
+    if (count > 0 && block_kind(raw) != NODE_COMMAND) {
+        *depth = 1;
+        *barrier = block_kind(raw) == NODE_FUNCTION;
+    } else if (count == 1 && (strcmp(raw[0], "done") == 0 || strcmp(raw[0], "}") == 0)) {
+        *depth = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (raw[i] == op_background)
+            *barrier = true;
+        // The command name is the first word, or the one after then/else
+        if ((i == 0 || (i == 1 && *continues && count > 0)) && word_changes_state(raw[i]))
+            *barrier = true;
+    }
+    arena_reset(&command_arena);
+}
+
+// Copies a worker's buffered output to fd, without a user copy where the kernel allows it.
+// copy_fd falls back to COPY_CHUNK reads and writes for an fd opened for appending.
+void flush_output(int memfd, int fd) {
+    lseek(memfd, 0, SEEK_SET); // The worker shared the offset and left it at the end
+    copy_fd(memfd, fd);
+    close(memfd);
+}
+
+// Starts a worker that runs the lines of a unit with its output captured in memory.
+// Returns -1, having started nothing, if there is no memory to capture the output in.
+int start_unit(unit_t* u) {
+    u->outfd = memfd_create("mysh-stdout", MFD_CLOEXEC);
+    u->errfd = memfd_create("mysh-stderr", MFD_CLOEXEC);
+    if (u->outfd < 0 || u->errfd < 0) {
+        if (u->outfd >= 0)
+            close(u->outfd);
+        if (u->errfd >= 0)
+            close(u->errfd);
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    long long start = TRACING ? now_ns() : 0;
+    u->pid = fork();
+    if (u->pid == 0) {
+        trace_child();
+        dup2(u->outfd, STDOUT_FILENO);
+        dup2(u->errfd, STDERR_FILENO);
+        terminal_owned = false; // Workers run side by side, none of them owns the terminal
+        run_text(u->text, u->len);
+        fflush(stdout);
+        trace_flush();
+        _exit(currstatus ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (TRACING) {
+        // The unit's text is not terminated; its first line names it
+        char first[sizeof(((trace_event_t*)NULL)->detail)];
+        size_t n = u->len < sizeof(first) - 1 ? u->len : sizeof(first) - 1;
+        const char *newline = memchr(u->text, '\n', n);
+        snprintf(first, sizeof(first), "%.*s", (int)(newline != NULL ? newline - u->text : n), u->text);
+        trace_event(TRACE_FORK, start, first, u->pid);
+    }
+    if (u->pid < 0) {
+        perror("fork");
+        u->status = 0;
+        u->done = true;
+        u->pidfd = -1;
+        return 0;
+    }
+    u->done = false;
+    u->pidfd = syscall(SYS_pidfd_open, u->pid, 0);
+    return 0;
+}
+
+// Waits until at least one running worker of the window has finished
+void wait_units(unit_t* window, int capacity, int head, int count) {
+    struct pollfd fds[capacity];
+    unit_t *owners[capacity];
+    int n = 0;
+    unit_t *oldest = NULL;
+    for (int i = 0; i < count; i++) {
+        unit_t *u = &window[(head + i) % capacity];
+        if (u->done)
+            continue;
+        if (oldest == NULL)
+            oldest = u;
+        if (u->pidfd >= 0) {
+            fds[n].fd = u->pidfd;
+            fds[n].events = POLLIN;
+            owners[n++] = u;
+        }
+    }
+    if (oldest == NULL)
+        return;
+
+    int status;
+    if (oldest->pidfd < 0) {
+        // Without pidfds, block on the oldest worker, which has to finish first anyway
+        waitpid(oldest->pid, &status, 0);
+        oldest->status = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        oldest->done = true;
+        return;
+    }
+    if (poll(fds, n, -1) <= 0)
+        return;
+    for (int i = 0; i < n; i++)
+        if (fds[i].revents & POLLIN) {
+            unit_t *u = owners[i];
+            waitpid(u->pid, &status, 0);
+            close(u->pidfd);
+            u->pidfd = -1;
+            u->status = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            u->done = true;
+        }
+}
+
+// Writes out the finished units at the front of the window in script order and returns how
+// many units are left. The status of the last one written is what the next line sees.
+int retire_units(unit_t* window, int capacity, int* head, int count) {
+    while (count > 0 && window[*head].done) {
+        unit_t *u = &window[*head];
+        flush_output(u->outfd, STDOUT_FILENO);
+        flush_output(u->errfd, STDERR_FILENO);
+        currstatus = u->status;
+        free(u->text);
+        *head = (*head + 1) % capacity;
+        count--;
+    }
+    return count;
+}
+
+// Runs a batch script with up to nworkers units at a time. A unit is a line together with the
+// then/else lines that follow it, so it only depends on lines outside it through the shell's
+// state; barrier lines wait for everything before them and then run in the shell itself.
+// Output is buffered per unit and written in script order, as in serial mode.
+void run_parallel(lines_t* L, int nworkers) {
+    int capacity = nworkers * 4;        // Units started but not yet flushed
+    unit_t *window = calloc(capacity, sizeof(unit_t));
+    int head = 0, count = 0, running = 0;
+
+    char *line = read_command(L);
+    while (line != NULL || count > 0) {
+        count = retire_units(window, capacity, &head, count);
+        running = 0;
+        for (int i = 0; i < count; i++)
+            running += !window[(head + i) % capacity].done;
+        if (line == NULL || count == capacity || running == nworkers) {
+            if (count > 0)
+                wait_units(window, capacity, head, count);
+            continue;
+        }
+
+        // Collect the next unit; read_command reuses the line, so the text is copied.
+        // A loop or function is kept whole, up to the line that closes it.
+        bool continues, barrier;
+        int depth, change;
+        classify_line(line, &continues, &barrier, &depth);
+        size_t len = 0, room = strlen(line) + 1;
+        char *text = malloc(room);
+        do {
+            append_text(&text, &len, &room, line);
+            if (strstr(line, "<<") != NULL) {
+                // Here-document bodies belong to the unit of the line that reads them
+                char *delims[16];
+                bool strip[16];
+                int n = heredoc_delimiters(line, delims, strip, 16);
+                for (int h = 0; h < n; h++)
+                    while ((line = read_command(L)) != NULL) {
+                        append_text(&text, &len, &room, line);
+                        if (is_heredoc_end(line, delims[h], strip[h]))
+                            break;
+                    }
+                arena_reset(&command_arena);
+            }
+            bool stop;
+            line = read_command(L);
+            if (line != NULL)
+                classify_line(line, &continues, &stop, &change);
+            if (line != NULL && (continues || depth > 0))
+                barrier |= stop;
+            if (line != NULL && depth > 0) {
+                depth += change;
+                continues = true;
+            }
+        } while (line != NULL && continues);
+
+        unit_t *u = &window[(head + count) % capacity];
+        u->text = text;
+        u->len = len;
+        if (!barrier && start_unit(u) == 0) {
+            count++;
+            continue;
+        }
+
+        // Everything before a barrier, or a unit whose output could not be buffered, finishes
+        // and is written before it runs in the shell itself
+        while ((count = retire_units(window, capacity, &head, count)) > 0)
+            wait_units(window, capacity, head, count);
+        run_text(text, len);
+        fflush(stdout);
+        free(text);
+    }
+    free(window);
+}
+
+// Runs scripts for clients connecting to a Unix socket at path, so that a short job does not
+// pay for starting a shell. The socket is SOCK_SEQPACKET: a client's first message holds its
+// working directory and carries its stdin, stdout and stderr as SCM_RIGHTS, the following
+// messages (at most SERVE_CHUNK bytes each) hold the script, and an empty message or
+// shutdown ends it. The server answers with the exit status as an int once the script ran.
+// Clients are served by copies of the server forked ahead of time, which wait in accept(),
+// so clients run side by side and no fork is left between a client and its job. A copy
+// whose script left the shell as it found it goes back to accept() for the next client; one
+// whose script changed the shell (see shell_changed) exits, so cd, variables or functions
+// of one client never reach another. The copies mark themselves waiting or busy in a shared
+// table, and the server forks new ones while fewer than SERVE_SPARES are waiting.
+int serve(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mysh: socket path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(path); // Left behind by a server that was killed
+
+    // Whoever can connect runs commands as this user, so only this user may. The umask
+    // covers the moment between bind and chmod.
+    mode_t mask = umask(0177);
+    int bound = sock < 0 ? -1 : bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    int wake[2]; // A copy that took the last waiting slot writes a byte, so more are forked
+    if (bound < 0 || chmod(path, 0600) < 0 || listen(sock, SOMAXCONN) < 0 ||
+        pipe2(wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    char *slots = mmap(NULL, SERVE_COPIES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int self = syscall(SYS_pidfd_open, getpid(), 0); // Copies that die are noticed through pidfds
+    if (slots == MAP_FAILED || self < 0) {
+        perror("mysh: --serve");
+        return EXIT_FAILURE;
+    }
+    close(self);
+
+    interactive_mode = false;
+    terminal_owned = false;
+    signal(SIGCHLD, SIG_IGN); // Nobody waits for the copies serving clients, the kernel reaps them
+    pid_t server = getpid();
+    int pidfds[SERVE_COPIES]; // Of the copy in each slot that is not free
+    while (1) {
+        int waiting = count_waiting(slots);
+        for (int slot = 0; slot < SERVE_COPIES && waiting < SERVE_SPARES; slot++) {
+            if (slots[slot] != SLOT_FREE)
+                continue;
+            slots[slot] = SLOT_WAITING;
+            pid_t pid = fork();
+            if (pid == 0) {
+                // A waiting copy goes away with the server; a client that was accepted is
+                // still served
+                trace_child();
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if (getppid() != server)
+                    _exit(EXIT_SUCCESS);
+                close(wake[0]);
+                signal(SIGCHLD, SIG_DFL); // The script waits for its own commands
+                serving_pid = getpid();
+                on_exit(send_serve_status, NULL);
+                while (1) {
+                    int conn;
+                    while ((conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+                        if (errno != EINTR && errno != ECONNABORTED) {
+                            perror("accept");
+                            sleep(1); // Out of descriptors or memory: do not replace it at once
+                            _exit(EXIT_FAILURE);
+                        }
+                    prctl(PR_SET_PDEATHSIG, 0);
+                    __atomic_store_n(&slots[slot], SLOT_BUSY, __ATOMIC_SEQ_CST);
+                    if (count_waiting(slots) == 0)
+                        write(wake[1], "", 1);
+                    serve_client(conn); // Exits if the script changed the shell
+                    if (count_waiting(slots) >= SERVE_SPARES)
+                        exit(EXIT_SUCCESS); // Enough copies are waiting after a busy spell
+                    prctl(PR_SET_PDEATHSIG, SIGTERM);
+                    if (getppid() != server)
+                        _exit(EXIT_SUCCESS);
+                    __atomic_store_n(&slots[slot], SLOT_WAITING, __ATOMIC_SEQ_CST);
+                }
+            }
+            if (pid < 0 || (pidfds[slot] = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+                perror(pid < 0 ? "fork" : "pidfd_open");
+                if (pid > 0)
+                    kill(pid, SIGKILL);
+                slots[slot] = SLOT_FREE;
+                sleep(1);
+                break;
+            }
+            waiting++;
+        }
+
+        struct pollfd fds[SERVE_COPIES + 1] = {{.fd = wake[0], .events = POLLIN}};
+        int owner[SERVE_COPIES + 1], n = 1;
+        for (int slot = 0; slot < SERVE_COPIES; slot++)
+            if (slots[slot] != SLOT_FREE) {
+                fds[n] = (struct pollfd){.fd = pidfds[slot], .events = POLLIN};
+                owner[n++] = slot;
+            }
+        if (poll(fds, n, -1) < 0)
+            continue;
+        char drain[64];
+        while (read(wake[0], drain, sizeof(drain)) > 0)
+            ;
+        // A copy that exited, or was killed while waiting, frees its slot
+        for (int i = 1; i < n; i++)
+            if (fds[i].revents != 0) {
+                close(pidfds[owner[i]]);
+                slots[owner[i]] = SLOT_FREE;
+            }
+    }
+}
+
+// Counts the copies of the server waiting in accept()
+int count_waiting(const char* slots) {
+    int waiting = 0;
+    for (int slot = 0; slot < SERVE_COPIES; slot++)
+        waiting += __atomic_load_n(&slots[slot], __ATOMIC_SEQ_CST) == SLOT_WAITING;
+    return waiting;
+}
+
+// Runs the script of one client in a copy of the server. If the script left the shell as it
+// found it, the client gets its status and the copy returns to serve another one with its
+// own stdin, stdout and stderr back; otherwise the copy exits with the status, which the
+// on_exit handler sends, as it does when the script runs exit.
+void serve_client(int conn) {
+    char cwd[PATH_MAX + 1];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {cwd, PATH_MAX};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *c = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (c == NULL || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(3 * sizeof(int)) || (msg.msg_flags & MSG_TRUNC)) {
+        if (c != NULL && c->cmsg_type == SCM_RIGHTS) // Not a mysh-client; it gets no answer
+            for (int *fd = (int*)CMSG_DATA(c); (char*)(fd + 1) <= (char*)c + c->cmsg_len; fd++)
+                close(*fd);
+        close(conn);
+        return;
+    }
+    int fds[3], saved[3];
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        dup2(fds[i], i);
+        if (fds[i] > STDERR_FILENO)
+            close(fds[i]);
+    }
+    cwd[n] = '\0';
+
+    serving_conn = conn;
+    shell_changed = false;
+    currstatus = 1;
+    if (chdir(cwd) != 0) {
+        perror(cwd);
+        exit(EXIT_FAILURE);
+    }
+
+    // The script is collected first, so that here-documents and loop bodies can be read ahead
+    size_t len = 0, room = 2 * SERVE_CHUNK;
+    char *text = malloc(room);
+    while ((n = recv(conn, text + len, room - len, 0)) > 0) {
+        len += n;
+        if (room - len < SERVE_CHUNK) {
+            room *= 2;
+            text = realloc(text, room);
+        }
+    }
+    run_text(text, len);
+    free(text);
+    if (shell_changed)
+        exit(currstatus ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    send_serve_status(currstatus ? EXIT_SUCCESS : EXIT_FAILURE, NULL);
+    for (int i = 0; i < 3; i++) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        } else {
+            close(i);
+        }
+    }
+}
+
+// Flushes the output of a served script and tells its client how it ended. Also the on_exit
+// handler of the copies of the server, so that a script that exits is answered too.
+void send_serve_status(int status, void* arg) {
+    if (getpid() != serving_pid || serving_conn < 0)
+        return; // A forked copy, such as the one running a command substitution, or no client
+    fflush(stdout);
+    fflush(stderr);
+    send(serving_conn, &status, sizeof(status), MSG_NOSIGNAL);
+    close(serving_conn);
+    serving_conn = -1;
+}
+
+// Returns size bytes from the arena, 8-byte aligned. The memory stays valid until arena_reset.
+void *arena_alloc(arena_t* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena_block_t *b = arena->head;
+    if (b == NULL || b->size - b->used < size) {
+        size_t blocksize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(arena_block_t) + blocksize);
+        if (b == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        b->size = blocksize;
+        b->used = 0;
+        b->next = arena->head;
+        arena->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+// Copies len bytes of s into the arena as a terminated string
+char *arena_strndup(arena_t* arena, const char* s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Releases everything allocated from the arena, keeping its newest block for reuse
+void arena_reset(arena_t* arena) {
+    arena_block_t *b = arena->head;
+    if (b == NULL)
+        return;
+    while (b->next != NULL) {
+        arena_block_t *old = b->next;
+        b->next = old->next;
+        free(old);
+    }
+    b->used = 0;
+}
+
+// Moves every block of src into dst, so memory allocated from src lives as long as dst's
+void arena_adopt(arena_t* dst, arena_t* src) {
+    if (src->head == NULL)
+        return;
+    arena_block_t *last = src->head;
+    while (last->next != NULL)
+        last = last->next;
+    if (dst->head == NULL) {
+        dst->head = src->head;
+    } else { // Keep allocating from dst's current block
+        last->next = dst->head->next;
+        dst->head->next = src->head;
+    }
+    src->head = NULL;
+}
+
+// Remembers how much of the arena is in use, for arena_release
+arena_mark_t arena_mark(arena_t* arena) {
+    if (arena->head == NULL)
+        arena_alloc(arena, 0); // Keep a block to come back to, so releasing never frees them all
+    arena_mark_t mark = {arena->head, arena->head->used, arena->head->next};
+    return mark;
+}
+
+// Frees everything allocated from the arena since the mark was taken
+void arena_release(arena_t* arena, arena_mark_t mark) {
+    while (arena->head != mark.block) {
+        arena_block_t *b = arena->head;
+        arena->head = b->next;
+        free(b);
+    }
+    while (mark.block->next != mark.older) { // Blocks that arena_adopt put behind the current one
+        arena_block_t *b = mark.block->next;
+        mark.block->next = b->next;
+        free(b);
+    }
+    mark.block->used = mark.used;
+}
+
+// Reports whether c ends an unquoted word
+int is_word_break(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '|' || c == '<' || c == '>' || c == '&';
+}
+
+// Splits a command line into raw words and operators in a single pass. Operators are
+// recognized wherever they appear, with or without spaces around them. Words are copied
+// into the command arena with their quotes intact, for expand_word to interpret.
+// Returns the number of tokens, or -1 after printing a syntax error.
+int lex_command(const char* line, words_t* raw) {
+    words_init(raw);
+    const char *p = line;
+    while (*p != '\0') {
+        if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+            continue;
+        }
+        if (*p == '#')
+            break; // A comment runs to the end of the line
+
+        if (p[0] == '<' && p[1] == '<') { // <<, <<- and <<<
+            words_push(raw, p[2] == '<' ? op_herestring : p[2] == '-' ? op_heredoc_strip : op_heredoc);
+            p += p[2] == '<' || p[2] == '-' ? 3 : 2;
+            continue;
+        }
+        if (*p == '|' || *p == '<' || *p == '>' || *p == '&') {
+            words_push(raw, *p == '|' ? op_pipe : *p == '<' ? op_input : *p == '>' ? op_output : op_background);
+            p++;
+            continue;
+        }
+
+        // A word runs to the next blank or operator character outside of quotes
+        const char *start = p;
+        char quote = '\0';
+        while (*p != '\0' && (quote != '\0' || !is_word_break(*p))) {
+            if (quote != '\0') {
+                if (*p == quote)
+                    quote = '\0';
+                else if (quote == '"' && *p == '\\' && p[1] != '\0')
+                    p++;
+            } else if (*p == '\'' || *p == '"') {
+                quote = *p;
+            } else if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            if (quote != '\'' && p[0] == '$' && p[1] == '(') {
+                // A command substitution belongs to the word, blanks and operators included
+                const char *end = skip_substitution(p);
+                if (end == NULL) {
+                    fprintf(stderr, "mysh: unterminated $(\n");
+                    return -1;
+                }
+                p = end;
+                continue;
+            }
+            p++;
+        }
+        if (quote != '\0') {
+            fprintf(stderr, "mysh: unterminated %c quote\n", quote);
+            return -1;
+        }
+        words_push(raw, arena_strndup(&command_arena, start, p - start));
+    }
+    return raw->count;
+}
+
+// Finds the end of the command substitution starting at p, which points to "$(". Quotes
+// and nested parentheses inside it are skipped. Returns the character after the closing
+// parenthesis, or NULL if it is missing.
+const char *skip_substitution(const char* p) {
+    int depth = 0;
+    char quote = '\0';
+    for (p++; *p != '\0'; p++) {
+        if (quote != '\0') {
+            if (*p == quote)
+                quote = '\0';
+            else if (quote == '"' && *p == '\\' && p[1] != '\0')
+                p++;
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// Starts an empty word array
+void words_init(words_t* w) {
+    w->room = 16;
+    w->items = arena_alloc(&command_arena, w->room * sizeof(char*));
+    w->items[0] = NULL;
+    w->count = 0;
+}
+
+// Appends a word, doubling the array when it is full. The old array stays in the arena
+// until it is reset, which at most doubles what the words take.
+void words_push(words_t* w, char* word) {
+    if (w->count + 1 == w->room) {
+        char **items = arena_alloc(&command_arena, 2 * w->room * sizeof(char*));
+        memcpy(items, w->items, w->count * sizeof(char*));
+        w->items = items;
+        w->room *= 2;
+    }
+    w->items[w->count++] = word;
+    w->items[w->count] = NULL;
+}
+
+// Removes the quotes from a raw word and expands its unquoted wildcards, appending the
+// resulting arguments to tokens. Returns the number of arguments added.
+int expand_word(const char* raw, words_t* tokens) {
+    size_t len = strlen(raw);
+    char *value = arena_alloc(&command_arena, len + 1);       // The word without quotes
+    char *pattern = arena_alloc(&command_arena, 2 * len + 1); // The same with quoted wildcards escaped
+    int vlen = 0, plen = 0;
+    bool has_wildcard = false;
+    char quote = '\0';
+
+    for (const char *p = raw; *p != '\0'; p++) {
+        bool quoted = true;
+        if (quote == '\0' && (*p == '\'' || *p == '"')) {
+            quote = *p; // Opening quote, not part of the value
+            continue;
+        } else if (quote != '\0' && *p == quote) {
+            quote = '\0'; // Closing quote
+            continue;
+        } else if (quote == '\0' && *p == '\\' && p[1] != '\0') {
+            p++; // A backslash quotes the next character
+        } else if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) {
+            p++; // Inside double quotes it only escapes these
+        } else if (quote == '\0') {
+            quoted = false;
+        }
+
+        if (!quoted && (*p == '*' || *p == '?' || *p == '['))
+            has_wildcard = true;
+        else if (quoted && (*p == '*' || *p == '?' || *p == '[' || *p == '\\'))
+            pattern[plen++] = '\\';
+        pattern[plen++] = *p;
+        value[vlen++] = *p;
+    }
+    value[vlen] = pattern[plen] = '\0';
+
+    if (has_wildcard) {
+        long long start = TRACING ? now_ns() : 0;
+        int matches = check_wildcard(pattern, tokens);
+        if (TRACING)
+            trace_event(TRACE_GLOB, start, pattern, matches);
+        if (matches > 0)
+            return matches;
+    }
+    words_push(tokens, value); // No wildcard, or nothing matched: the word stands for itself
+    return 1;
+}
+
+// Copies a raw word without its quotes and without expanding anything
+char *remove_quotes(const char* raw) {
+    char *word = arena_alloc(&command_arena, strlen(raw) + 1);
+    size_t n = 0;
+    char quote = '\0';
+    for (const char *p = raw; *p != '\0'; p++) {
+        if (quote == '\0' && (*p == '\'' || *p == '"'))
+            quote = *p;
+        else if (quote != '\0' && *p == quote)
+            quote = '\0';
+        else {
+            if (*p == '\\' && p[1] != '\0' && (quote == '\0' || (quote == '"' && strchr("\"\\$`", p[1]) != NULL)))
+                p++;
+            word[n++] = *p;
+        }
+    }
+    word[n] = '\0';
+    return word;
+}
+
+// Reports whether a line ends a here-document; with <<- leading tabs are ignored
+int is_heredoc_end(const char* line, const char* delimiter, bool strip_tabs) {
+    if (strip_tabs)
+        while (*line == '\t')
+            line++;
+    return strcmp(line, delimiter) == 0;
+}
+
+// Finds the here-document delimiters of a line without reading their bodies, for
+// parallel batch mode. The delimiters are allocated from the command arena.
+int heredoc_delimiters(const char* line, char* delims[], bool strip[], int max) {
+    words_t words;
+    int count = lex_command(line, &words), n = 0;
+    char **raw = words.items;
+    for (int i = 0; i + 1 < count && n < max; i++)
+        if (raw[i] == op_heredoc || raw[i] == op_heredoc_strip) {
+            strip[n] = raw[i] == op_heredoc_strip;
+            delims[n++] = remove_quotes(raw[i + 1]);
+        }
+    return n;
+}
+
+// Reads the body of a here-document from the lines that follow the current one, up to the
+// delimiter line. Returns the text, allocated from the command arena.
+char *read_heredoc(const char* delimiter, bool strip_tabs) {
+    lines_t *L = command_input;
+    if (L == NULL)
+        return arena_strndup(&command_arena, "", 0);
+    // The current line stays valid while the body is read after it
+    char *current = L->line;
+    L->line = NULL;
+
+    size_t len = 0, room = 256;
+    char *body = malloc(room);
+    while (1) {
+        if (interactive_mode)
+            print_continuation_prompt();
+        char *line = read_command(L);
+        if (line == NULL) {
+            fprintf(stderr, "mysh: here-document ended by end of file (wanted '%s')\n", delimiter);
+            break;
+        }
+        if (is_heredoc_end(line, delimiter, strip_tabs))
+            break;
+        if (strip_tabs)
+            while (*line == '\t')
+                line++;
+        append_text(&body, &len, &room, line);
+    }
+    free(L->line);
+    L->line = current;
+
+    char *text = arena_strndup(&command_arena, body, len);
+    free(body);
+    return text;
+}
+
+// Reads the bodies of a line's here-documents from the lines after it, replacing each << or
+// <<- and its delimiter with op_here_text and the body. Returns -1 after a syntax error.
+int read_heredocs(char* raw[]) {
+    for (int i = 0; raw[i] != NULL; i++) {
+        if (raw[i] != op_heredoc && raw[i] != op_heredoc_strip && raw[i] != op_herestring)
+            continue;
+        // The word after the operator is a delimiter or text, never a file name or pattern
+        if (raw[i + 1] == NULL || is_operator(raw[i + 1])) {
+            fprintf(stderr, "mysh: syntax error near '%s'\n", raw[i]);
+            return -1;
+        }
+        if (raw[i] != op_herestring) {
+            bool strip_tabs = raw[i] == op_heredoc_strip;
+            raw[i] = op_here_text;
+            raw[i + 1] = read_heredoc(remove_quotes(raw[i + 1]), strip_tabs);
+        }
+        i++;
+    }
+    return 0;
+}
+
+// Reports whether a raw word is one of the lexer's operators
+int is_operator(const char* word) {
+    return word == op_pipe || word == op_input || word == op_output || word == op_background ||
+           word == op_heredoc || word == op_heredoc_strip || word == op_herestring || word == op_here_text ||
+           word == op_assign;
+}
+
+// Expands the raw words of a lexed command into the tokens to execute: variables are
+// substituted, quotes removed and wildcards matched. The tokens live in the command arena.
+// Returns 0 on success, or -1 on an error.
+int parse_command(char* raw[], words_t* tokens) {
+    long long start = TRACING ? now_ns() : 0;
+    words_init(tokens);
+    substituted = false;
+    bool command_start = true; // No command name yet, so NAME=VALUE is an assignment
+    for (int i = 0; raw[i] != NULL; i++) {
+        if (command_start && is_assignment(raw[i])) {
+            // The value is substituted and unquoted, but neither split nor globbed
+            words_push(tokens, op_assign);
+            words_push(tokens, remove_quotes(substitute_variables(raw[i])));
+            continue;
+        }
+        command_start = command_start && (strcmp(raw[i], "then") == 0 || strcmp(raw[i], "else") == 0);
+        if (raw[i] == op_here_text) {
+            words_push(tokens, op_here_text);
+            words_push(tokens, raw[++i]);
+        } else if (raw[i] == op_herestring) {
+            char *word = remove_quotes(substitute_variables(raw[++i]));
+            size_t len = strlen(word);
+            char *data = arena_alloc(&command_arena, len + 2);
+            memcpy(data, word, len);
+            data[len] = '\n';
+            data[len + 1] = '\0';
+            words_push(tokens, op_here_text);
+            words_push(tokens, data);
+        } else if (is_operator(raw[i])) {
+            words_push(tokens, raw[i]); // Operators are kept as they are
+        } else {
+            char *word = substitute_variables(raw[i]);
+            if (word == raw[i])
+                expand_word(word, tokens);
+            else
+                split_fields(word, tokens); // Unquoted values are split before they are globbed
+        }
+    }
+    if (TRACING)
+        trace_event(TRACE_PARSE, start, raw[0], tokens->count);
+    return 0;
+}
+
+// Splits a word whose variables and command substitutions were substituted at the blanks
+// outside quotes, as sh does with IFS left at its default, and expands each field. An
+// unquoted value that is empty or only blanks leaves no field at all, while "" is an empty
+// field. Returns the number of arguments added.
+int split_fields(char* word, words_t* tokens) {
+    int added = 0;
+    char *p = word;
+    while (*p != '\0') {
+        if (*p == ' ' || *p == '\t' || *p == '\n') {
+            p++;
+            continue;
+        }
+        char *start = p, quote = '\0';
+        for (; *p != '\0' && (quote != '\0' || (*p != ' ' && *p != '\t' && *p != '\n')); p++) {
+            if (quote != '\0') {
+                if (*p == quote)
+                    quote = '\0';
+                else if (quote == '"' && *p == '\\' && p[1] != '\0')
+                    p++;
+            } else if (*p == '\'' || *p == '"') {
+                quote = *p;
+            } else if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+        }
+        bool last = *p == '\0';
+        *p = '\0'; // The field ends here; the word is a copy in the command arena
+        added += expand_word(start, tokens);
+        if (last)
+            break;
+        p++;
+    }
+    return added;
+}
+
+// Looks up a variable: a name, a digit for an argument of the current function, # for the
+// number of arguments or ? for the exit status of the last command. Returns NULL if unset;
+// scratch has room for a formatted number.
+const char *variable_value(const char* name, size_t len, char* scratch) {
+    if (len == 1 && isdigit((unsigned char)name[0])) {
+        int n = name[0] - '0';
+        if (n == 0)
+            return positional_args != NULL ? positional_args[0] : "mysh";
+        return n <= positional_count ? positional_args[n] : NULL;
+    }
+    if (len == 1 && name[0] == '#') {
+        sprintf(scratch, "%d", positional_count);
+        return scratch;
+    }
+    if (len == 1 && name[0] == '?')
+        return currstatus ? "0" : "1";
+    variable_t *v = find_variable(name, len); // Found in place, the name is not copied
+    return v != NULL ? v->value : NULL;
+}
+
+// Hashes the first len characters of a variable name (FNV-1a)
+unsigned int hash_variable(const char* name, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+// Finds the variable named by the first len characters of name, or returns NULL. The
+// pointer is valid until a variable is added or removed.
+variable_t *find_variable(const char* name, size_t len) {
+    if (variable_count == 0)
+        return NULL;
+    unsigned int h = hash_variable(name, len), mask = variable_capacity - 1;
+    for (unsigned int i = h & mask; variables[i].name != NULL; i = (i + 1) & mask)
+        if (variables[i].hash == h && strncmp(variables[i].name, name, len) == 0 && variables[i].name[len] == '\0')
+            return &variables[i];
+    return NULL;
+}
+
+// Finds a variable, adding it without a value if it does not exist. The table doubles
+// when it would become more than half full.
+variable_t *define_variable(const char* name, size_t len) {
+    variable_t *v = find_variable(name, len);
+    if (v != NULL)
+        return v;
+    if (2 * (variable_count + 1) > variable_capacity) {
+        variable_t *old = variables;
+        int old_capacity = variable_capacity;
+        variable_capacity = variable_capacity == 0 ? 64 : 2 * variable_capacity;
+        variables = calloc(variable_capacity, sizeof(variable_t));
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].name == NULL)
+                continue;
+            unsigned int j = old[i].hash & (variable_capacity - 1);
+            while (variables[j].name != NULL)
+                j = (j + 1) & (variable_capacity - 1);
+            variables[j] = old[i];
+        }
+        free(old);
+    }
+    unsigned int h = hash_variable(name, len), mask = variable_capacity - 1, i = h & mask;
+    while (variables[i].name != NULL)
+        i = (i + 1) & mask;
+    v = &variables[i];
+    v->name = strndup(name, len);
+    v->hash = h;
+    variable_count++;
+    return v;
+}
+
+// Sets a shell variable. Its buffer is kept, so setting it on every pass of a loop does
+// not allocate.
+void set_variable(const char* name, const char* value) {
+    store_value(define_variable(name, strlen(name)), value);
+}
+
+// Copies a value into a variable, growing its buffer if needed
+void store_value(variable_t* v, const char* value) {
+    size_t len = strlen(value);
+    if (len + 1 > v->room) {
+        v->room = len + 1 > 32 ? len + 1 : 32;
+        v->value = realloc(v->value, v->room);
+    }
+    memcpy(v->value, value, len + 1);
+    if (v->exported)
+        environ_stale = true;
+    shell_changed = true;
+}
+
+// Removes a variable. The entries after it in its probe sequence are moved back into the
+// hole, so that lookups never need to skip deleted slots.
+void unset_variable(const char* name) {
+    variable_t *v = find_variable(name, strlen(name));
+    if (v == NULL)
+        return;
+    if (v->exported)
+        environ_stale = true;
+    shell_changed = true;
+    free(v->name);
+    free(v->value);
+    unsigned int mask = variable_capacity - 1, hole = v - variables;
+    for (unsigned int i = (hole + 1) & mask; variables[i].name != NULL; i = (i + 1) & mask) {
+        unsigned int home = variables[i].hash & mask;
+        // Move the entry unless its home slot lies after the hole, up to where it is
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            variables[hole] = variables[i];
+            hole = i;
+        }
+    }
+    memset(&variables[hole], 0, sizeof(variable_t));
+    variable_count--;
+}
+
+// Returns the value of a variable, or NULL if it is unset
+const char *get_variable(const char* name) {
+    variable_t *v = find_variable(name, strlen(name));
+    return v != NULL ? v->value : NULL;
+}
+
+// Makes the environment the shell was started with its exported variables
+void import_environment() {
+    for (char **e = environ; *e != NULL; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq == NULL)
+            continue;
+        variable_t *v = define_variable(*e, eq - *e);
+        store_value(v, eq + 1);
+        v->exported = true;
+    }
+}
+
+// Rebuilds environ from the exported variables if they changed since it was last built.
+// The strings and the array are allocated in one block.
+void update_environ() {
+    if (!environ_stale)
+        return;
+    size_t count = 0, bytes = 0;
+    for (int i = 0; i < variable_capacity; i++)
+        if (variables[i].name != NULL && variables[i].exported && variables[i].value != NULL) {
+            count++;
+            bytes += strlen(variables[i].name) + strlen(variables[i].value) + 2;
+        }
+    char **env = malloc((count + 1) * sizeof(char*) + bytes);
+    char *text = (char*)(env + count + 1);
+    size_t n = 0;
+    for (int i = 0; i < variable_capacity; i++)
+        if (variables[i].name != NULL && variables[i].exported && variables[i].value != NULL) {
+            env[n++] = text;
+            text = stpcpy(stpcpy(stpcpy(text, variables[i].name), "="), variables[i].value) + 1;
+        }
+    env[n] = NULL;
+    free(shell_environ);
+    environ = shell_environ = env;
+    environ_stale = false;
+}
+
+// Reports whether a raw word is an assignment: a name followed by '=', before any quote
+int is_assignment(const char* word) {
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+        return 0;
+    const char *p = word;
+    while (isalnum((unsigned char)*p) || *p == '_')
+        p++;
+    return *p == '=';
+}
+
+// Sets the variable of a NAME=VALUE token, exporting it if asked to
+void assign_variable(const char* assignment, bool export) {
+    const char *eq = strchr(assignment, '=');
+    variable_t *v = define_variable(assignment, eq - assignment);
+    store_value(v, eq + 1);
+    if (export && !v->exported) {
+        v->exported = true;
+        environ_stale = true;
+    }
+}
+
+// Replaces $NAME, ${NAME}, $1..$9, $# and $? in a raw word with their values, and $(command)
+// with the output of the command, quoted so that expand_word takes them literally; only
+// unquoted values keep their blanks and wildcards, for split_fields and expand_word. Nothing
+// is substituted inside single quotes. Returns the word itself when it contains no '$'.
+char *substitute_variables(const char* raw) {
+    if (strchr(raw, '$') == NULL)
+        return (char*)raw;
+    static char *out = NULL; // Reused, so that a substitution does not allocate
+    static size_t room = 0;
+    size_t len = 0;
+    char quote = '\0', scratch[32];
+    for (const char *p = raw; *p != '\0'; p++) {
+        const char *value = p;
+        size_t n = 1;
+        bool escape = false;
+        if (quote != '\'' && *p == '\\' && p[1] != '\0') {
+            n = 2; // Copied with the character it quotes
+        } else if (quote == '\0' && (*p == '\'' || *p == '"')) {
+            quote = *p;
+        } else if (quote != '\0' && *p == quote) {
+            quote = '\0';
+        } else if (*p == '$' && p[1] == '(' && quote != '\'') {
+            const char *end = skip_substitution(p);
+            if (end != NULL) {
+                // The command may substitute words of its own, which use a buffer of their own
+                char *mine = out;
+                size_t mine_room = room;
+                out = NULL;
+                room = 0;
+                value = capture_command(p + 2, end - p - 3, &n);
+                free(out);
+                out = mine;
+                room = mine_room;
+                escape = true;
+                p = end - 1;
+            }
+        } else if (*p == '$' && quote != '\'') {
+            const char *name = p + 1;
+            bool braced = *name == '{';
+            size_t namelen = 0;
+            if (braced)
+                namelen = strcspn(++name, "}");
+            else if (isdigit((unsigned char)*name) || *name == '#' || *name == '?')
+                namelen = 1;
+            else
+                while (isalnum((unsigned char)name[namelen]) || name[namelen] == '_')
+                    namelen++;
+            if (namelen > 0 && (!braced || name[namelen] == '}')) {
+                value = variable_value(name, namelen, scratch);
+                if (value == NULL)
+                    value = "";
+                n = strlen(value);
+                escape = true;
+                p = name + namelen + braced - 1;
+            }
+        }
+
+        if (len + 2 * n + 1 > room) {
+            room = (len + 2 * n + 1) * 2;
+            out = realloc(out, room);
+        }
+        for (size_t i = 0; i < n; i++) {
+            char c = value[i];
+            if (escape && (quote == '\0' ? strchr("'\"\\", c) != NULL : c == '"' || c == '\\'))
+                out[len++] = '\\';
+            out[len++] = c;
+        }
+        if (n == 2 && !escape)
+            p++;
+    }
+    return arena_strndup(&command_arena, out, len);
+}
+
+// Runs the command of a substitution and returns its output without the trailing newlines,
+// in a buffer that the next substitution reuses. A builtin that only prints, such as pwd or
+// echo, runs inside the shell with its stdout sent to a memfd; anything else runs in a
+// forked copy of the shell whose stdout is a pipe, read into the buffer as it grows.
+// The exit status of the command becomes the status of the shell.
+const char *capture_command(const char* text, size_t len, size_t* outlen) {
+    words_t words, tokens;
+    char *line = arena_strndup(&command_arena, text, len);
+    size_t n = 0;
+    *outlen = 0;
+    if (lex_command(line, &words) <= 0 || block_kind(words.items) != NODE_COMMAND ||
+        parse_command(words.items, &tokens) != 0 || tokens.count == 0)
+        return "";
+
+    fflush(stdout);
+    fflush(stderr);
+    if (runs_in_substitution(tokens.items)) {
+        if (capture_memfd < 0)
+            capture_memfd = memfd_create("mysh-substitution", MFD_CLOEXEC);
+        int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(capture_memfd, STDOUT_FILENO);
+        execute_full(tokens.items);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+
+        off_t size = lseek(capture_memfd, 0, SEEK_END);
+        if (size + 1 > (off_t)captured_room) {
+            captured_room = size + 1;
+            captured = realloc(captured, captured_room);
+        }
+        ssize_t got;
+        while (n < (size_t)size && (got = pread(capture_memfd, captured + n, size - n, n)) > 0)
+            n += got;
+        ftruncate(capture_memfd, 0);
+        lseek(capture_memfd, 0, SEEK_SET);
+    } else {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            currstatus = 0;
+            return "";
+        }
+        long long start = TRACING ? now_ns() : 0;
+        pid_t pid = fork();
+        if (pid == 0) {
+            trace_child();
+            close(fds[0]);
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[1]);
+            execute_full(tokens.items);
+            fflush(stdout);
+            trace_flush();
+            _exit(currstatus ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (TRACING && pid > 0)
+            trace_event(TRACE_FORK, start, tokens.items[0], pid);
+        close(fds[1]);
+        if (pid < 0) {
+            perror("fork");
+            close(fds[0]);
+            currstatus = 0;
+            return "";
+        }
+        long long waited = TRACING ? now_ns() : 0; // The command runs while its output is read
+        ssize_t got;
+        while (1) {
+            if (n + BUFSIZ + 1 > captured_room) {
+                captured_room = captured_room == 0 ? 2 * BUFSIZ : 2 * captured_room;
+                captured = realloc(captured, captured_room);
+            }
+            got = read(fds[0], captured + n, captured_room - n - 1);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            n += got;
+        }
+        close(fds[0]);
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        if (TRACING)
+            trace_wait(waited, pid, status);
+        currstatus = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    substituted = true;
+    if (captured == NULL)
+        return "";
+    captured[n] = '\0';
+    n = strlen(captured); // Like sh, the output ends at a NUL byte
+    while (n > 0 && captured[n - 1] == '\n')
+        n--;
+    *outlen = n;
+    return captured;
+}
+
+// Reports whether the command of a substitution can run inside the shell: a builtin that
+// neither changes the shell nor leaves a loop or function, outside a pipeline
+int runs_in_substitution(char* tokens[]) {
+    if (find_function(tokens[0]) != NULL)
+        return 0;
+    const builtin_t *b = builtin_for(tokens, -1);
+    if (b == NULL || b->shell_state || b->run == builtin_break || b->run == builtin_continue ||
+        b->run == builtin_return)
+        return 0;
+    for (int i = 0; tokens[i] != NULL; i++)
+        if (tokens[i] == op_pipe || tokens[i] == op_background)
+            return 0;
+    return 1;
+}
+
+// Tells whether a lexed line opens a loop or a function definition and returns its NODE_*
+int block_kind(char* raw[]) {
+    if (raw[0] == NULL)
+        return NODE_COMMAND;
+    size_t len = strlen(raw[0]);
+    if (strcmp(raw[0], "for") == 0 && raw[1] != NULL)
+        return NODE_FOR;
+    if (strcmp(raw[0], "while") == 0 && raw[1] != NULL)
+        return NODE_WHILE;
+    if ((strcmp(raw[0], "function") == 0 && raw[1] != NULL) || (len > 2 && strcmp(raw[0] + len - 2, "()") == 0) ||
+        (raw[1] != NULL && strcmp(raw[1], "()") == 0))
+        return NODE_FUNCTION;
+    return NODE_COMMAND;
+}
+
+// Copies raw words into an arena, keeping the operators, which are recognized by address
+char **copy_words(arena_t* arena, char* raw[]) {
+    int count = 0;
+    while (raw[count] != NULL)
+        count++;
+    char **words = arena_alloc(arena, (count + 1) * sizeof(char*));
+    for (int i = 0; i < count; i++)
+        words[i] = is_operator(raw[i]) ? raw[i] : arena_strndup(arena, raw[i], strlen(raw[i]));
+    words[count] = NULL;
+    return words;
+}
+
+// Compiles a loop or function from its header line, the lexed raw words, and the body lines
+// that follow it in the input:
+//     for NAME in WORDS...        while COMMAND        NAME() {
+//     do                          do                       ...
+//         ...                         ...              }
+//     done                        done
+// do may also end the header after a ';', and function NAME { is accepted too. Functions live
+// in function_arena, loops in the arena of what encloses them: block_arena, which is reset once
+// the line has run, at the top level and function_arena inside a function. Returns NULL after
+// a syntax error, having still read the body so that the script continues after it.
+node_t *compile_block(arena_t* arena, int kind, char* raw[], const char* line) {
+    if (kind == NODE_FUNCTION)
+        arena = &function_arena;
+    node_t *node = arena_alloc(arena, sizeof(node_t));
+    memset(node, 0, sizeof(node_t));
+    node->type = kind;
+    node->line = arena_strndup(arena, line, strlen(line));
+
+    int count = 0;
+    while (raw[count] != NULL)
+        count++;
+    const char *opener = kind == NODE_FUNCTION ? "{" : "do";
+    const char *closer = kind == NODE_FUNCTION ? "}" : "done";
+    bool opened = false, ok = true;
+    if (kind != NODE_FUNCTION && count > 2 && strcmp(raw[count - 1], "do") == 0) {
+        size_t len = strlen(raw[count - 2]);
+        if (raw[count - 2][len - 1] == ';') {
+            opened = true;
+            raw[--count] = NULL;
+            raw[count - 1][len - 1] = '\0';
+            if (len == 1)
+                raw[--count] = NULL;
+        }
+    }
+    // The body starts on the next line; a whole loop on one line would swallow the script
+    for (int i = 1; i < count; i++)
+        if (strcmp(raw[i], opener) == 0 || strcmp(raw[i], closer) == 0) {
+            if (kind == NODE_FUNCTION && i == count - 1 && strcmp(raw[i], "{") == 0) {
+                opened = true;
+                raw[--count] = NULL;
+                break;
+            }
+            fprintf(stderr, "mysh: the body of '%s' must start on a new line\n", raw[0]);
+            return NULL;
+        }
+
+    if (kind == NODE_FOR) {
+        ok = count >= 3 && strcmp(raw[2], "in") == 0 && (isalpha((unsigned char)raw[1][0]) || raw[1][0] == '_') &&
+             strspn(raw[1], "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") == strlen(raw[1]);
+        if (ok) {
+            node->name = arena_strndup(arena, raw[1], strlen(raw[1]));
+            node->words = copy_words(arena, raw + 3);
+        } else {
+            fprintf(stderr, "mysh: syntax error: for NAME in WORDS...\n");
+        }
+    } else if (kind == NODE_WHILE) {
+        ok = read_heredocs(raw) == 0;
+        node->words = copy_words(arena, raw + 1);
+    } else {
+        // NAME(), NAME () or function NAME
+        char *name = strcmp(raw[0], "function") == 0 ? raw[1] : raw[0];
+        int words = strcmp(raw[0], "function") == 0 ? 2 : 1;
+        if (raw[words] != NULL && strcmp(raw[words], "()") == 0)
+            words++;
+        size_t len = strlen(name);
+        if (len > 2 && strcmp(name + len - 2, "()") == 0)
+            len -= 2;
+        ok = count == words && len > 0 && strcspn(name, "'\"\\$*?[/") >= len;
+        if (ok)
+            node->name = arena_strndup(arena, name, len);
+        else
+            fprintf(stderr, "mysh: syntax error: invalid function definition\n");
+    }
+
+    // The header line stays valid while the body is read after it
+    lines_t *L = command_input;
+    char *current = L != NULL ? L->line : NULL;
+    if (L != NULL)
+        L->line = NULL;
+    node->body = compile_body(arena, opened ? NULL : opener, closer, &ok);
+    if (L != NULL) {
+        free(L->line);
+        L->line = current;
+    }
+    return ok ? node : NULL;
+}
+
+// Compiles the statements of a body from the lines after its header, up to the line that
+// closes it (done or }). The opening line (do or {) is optional for loops and required for
+// functions; opener is NULL when the header already opened the body. ok is cleared on errors.
+node_t *compile_body(arena_t* arena, const char* opener, const char* closer, bool* ok) {
+    node_t *first = NULL, **last = &first;
+    bool first_line = true;
+    while (1) {
+        if (interactive_mode)
+            print_continuation_prompt();
+        char *line = command_input != NULL ? read_command(command_input) : NULL;
+        if (line == NULL) {
+            fprintf(stderr, "mysh: end of file before '%s'\n", closer);
+            *ok = false;
+            break;
+        }
+        words_t words;
+        int count = lex_command(line, &words);
+        char **raw = words.items;
+        if (count <= 0) {
+            *ok = *ok && count == 0;
+            continue;
+        }
+        if (first_line && opener != NULL) {
+            first_line = false;
+            if (count == 1 && strcmp(raw[0], opener) == 0)
+                continue;
+            if (strcmp(opener, "{") == 0) {
+                fprintf(stderr, "mysh: syntax error: expected '{'\n");
+                *ok = false;
+            }
+        }
+        if (count == 1 && strcmp(raw[0], closer) == 0)
+            break;
+
+        node_t *node;
+        int kind = block_kind(raw);
+        if (kind != NODE_COMMAND) {
+            node = compile_block(arena, kind, raw, line);
+            *ok = *ok && node != NULL;
+        } else {
+            node = arena_alloc(arena, sizeof(node_t));
+            memset(node, 0, sizeof(node_t));
+            node->type = NODE_COMMAND;
+            node->line = arena_strndup(arena, line, strlen(line));
+            *ok = *ok && read_heredocs(raw) == 0;
+            node->words = copy_words(arena, raw);
+        }
+        if (node != NULL) {
+            *last = node;
+            last = &node->next;
+        }
+    }
+    return first;
+}
+
+// Substitutes, expands and runs the raw words of one compiled command. What the expansion
+// allocates is released afterwards, so a body that runs a million times stays the same size.
+void run_words(char* words[], const char* line) {
+    words_t tokens;
+    arena_mark_t mark = arena_mark(&command_arena);
+    current_line = line;
+    long long start = now_ns();
+    int parsed = parse_command(words, &tokens);
+    parse_ns = now_ns() - start;
+    if (parsed == 0)
+        execute_full(tokens.items);
+    else
+        currstatus = 0;
+    arena_release(&command_arena, mark);
+}
+
+// Called by a loop after each pass: takes a break or continue that leaves this loop into
+// account and reports whether the loop has to stop
+int loop_ended() {
+    if (function_return)
+        return 1;
+    if (loop_jump == 0)
+        return 0;
+    if (--loop_jump == 0 && jump_continue) {
+        jump_continue = false;
+        return 0;
+    }
+    return 1;
+}
+
+// Runs a list of compiled statements. The status of a loop is that of the last command of
+// its body, or success if the body never ran.
+void run_nodes(node_t* node) {
+    for (; node != NULL && loop_jump == 0 && !function_return; node = node->next) {
+        if (node->type == NODE_COMMAND) {
+            run_words(node->words, node->line);
+        } else if (node->type == NODE_FOR) {
+            // The list is expanded when the loop starts, so wildcards see the files of that moment
+            words_t values;
+            arena_mark_t mark = arena_mark(&command_arena);
+            current_line = node->line;
+            parse_command(node->words, &values);
+            int status = 1;
+            loop_depth++;
+            for (int i = 0; i < values.count; i++) {
+                set_variable(node->name, values.items[i]);
+                run_nodes(node->body);
+                status = currstatus;
+                if (loop_ended())
+                    break;
+            }
+            loop_depth--;
+            currstatus = status;
+            arena_release(&command_arena, mark);
+        } else if (node->type == NODE_WHILE) {
+            int status = 1;
+            loop_depth++;
+            while (1) {
+                run_words(node->words, node->line);
+                if (loop_ended() || !currstatus)
+                    break;
+                run_nodes(node->body);
+                status = currstatus;
+                if (loop_ended())
+                    break;
+            }
+            loop_depth--;
+            currstatus = status;
+        } else {
+            define_function(node);
+        }
+    }
+}
+
+// Finds a defined function by name, or returns NULL
+function_t *find_function(const char* name) {
+    if (nfunctions == 0)
+        return NULL;
+    for (function_t *f = functions[hash_name(name)]; f != NULL; f = f->next)
+        if (strcmp(f->name, name) == 0)
+            return f;
+    return NULL;
+}
+
+// Defines a function, replacing an earlier one with the same name. A definition is compiled
+// once, when it is read, so running it again in a loop costs no memory; but every definition
+// read stays in function_arena, even after a later one replaced it.
+void define_function(node_t* node) {
+    function_t *f = find_function(node->name);
+    if (f == NULL) {
+        f = arena_alloc(&function_arena, sizeof(function_t));
+        f->name = node->name;
+        unsigned int bucket = hash_name(node->name);
+        f->next = functions[bucket];
+        functions[bucket] = f;
+        nfunctions++;
+    }
+    f->body = node->body;
+    f->shell_state = nodes_change_state(node->body);
+    shell_changed = true;
+    currstatus = 1;
+}
+
+// Reports whether a command name changes the shell's state when it runs: a builtin that
+// does, or a function whose body does
+int word_changes_state(const char* word) {
+    if (is_assignment(word))
+        return 1;
+    const builtin_t *b = find_builtin(word);
+    if (b != NULL)
+        return b->shell_state;
+    function_t *f = find_function(word);
+    return f != NULL && f->shell_state;
+}
+
+// Reports whether compiled statements change shell state: define functions, start background
+// jobs or run a command that changes state
+int nodes_change_state(node_t* node) {
+    for (; node != NULL; node = node->next) {
+        if (node->type == NODE_FUNCTION || nodes_change_state(node->body))
+            return 1;
+        if (node->type != NODE_COMMAND || node->words[0] == NULL)
+            continue;
+        char **words = node->words;
+        if ((strcmp(words[0], "then") == 0 || strcmp(words[0], "else") == 0) && words[1] != NULL)
+            words++;
+        if (word_changes_state(words[0]))
+            return 1;
+        for (int i = 0; words[i] != NULL; i++)
+            if (words[i] == op_background)
+                return 1;
+    }
+    return 0;
+}
+
+// Runs a function with the given command line as its arguments
+void call_function(function_t* f, char* tokens[]) {
+    char **saved_args = positional_args;
+    int saved_count = positional_count, saved_depth = loop_depth;
+    positional_args = tokens;
+    for (positional_count = 0; tokens[positional_count + 1] != NULL; positional_count++)
+        ;
+    loop_depth = 0; // break and continue only apply to loops inside the function
+    function_depth++;
+    currstatus = 1;
+    run_nodes(f->body);
+    function_depth--;
+    function_return = false;
+    loop_jump = 0;
+    loop_depth = saved_depth;
+    positional_args = saved_args;
+    positional_count = saved_count;
+}
+
+// Determines if a command contains a slash '/', indicating a direct pathname.
+// Returns 1 if true, indicating a direct pathname.
+int check_slash(char* command) {
+    for (int i = 0; command[i] != '\0'; i++)
+        if (command[i] == '/')
+            return 1; // Slash found, indicating a direct pathname
+    return 0; // No slash found, not a direct pathname
+}
+
+// Searches each directory of $PATH for an executable called name.
+// The full path is written to result; returns 1 if one was found.
+int search_path(const char* name, char* result, size_t size) {
+    const char *path_env = get_variable("PATH");
+    if (path_env == NULL)
+        path_env = DEFAULT_PATH;
+
+    // Walk the ':' separated list in place instead of copying it for strtok
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        int dirlen = end ? (int)(end - dir) : (int)strlen(dir);
+        if (dirlen == 0) // An empty entry means the current directory
+            snprintf(result, size, "./%s", name);
+        else
+            snprintf(result, size, "%.*s/%s", dirlen, dir, name);
+
+        if (access(result, X_OK) == 0)
+            return 1;
+        if (end == NULL)
+            return 0;
+        dir = end + 1;
+    }
+}
+
+// Hashes a command name into a bucket index (FNV-1a)
+unsigned int hash_name(const char* name) {
+    unsigned int h = 2166136261u;
+    for (; *name != '\0'; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h % HASH_BUCKETS;
+}
+
+// Empties the executable lookup cache
+void hash_flush() {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        while (command_hash[i] != NULL) {
+            hash_entry_t *e = command_hash[i];
+            command_hash[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(hashed_path_env);
+    hashed_path_env = NULL;
+}
+
+// Removes a single command from the lookup cache
+void hash_forget(const char* name) {
+    for (hash_entry_t **link = &command_hash[hash_name(name)]; *link != NULL; link = &(*link)->next) {
+        hash_entry_t *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+// Returns the full path of a bare command name, or NULL if it is not in $PATH.
+// Results are remembered so that repeated commands skip the directory search.
+// Cached paths are not probed again: when launching one fails because it is
+// gone or no longer executable, the caller drops it with hash_forget.
+const char* lookup_command(const char* name) {
+    // The whole table is stale if $PATH changed since it was filled
+    const char *path_env = get_variable("PATH");
+    if (path_env == NULL)
+        path_env = DEFAULT_PATH;
+    if (hashed_path_env != NULL && strcmp(hashed_path_env, path_env) != 0)
+        hash_flush();
+
+    long long start = TRACING ? now_ns() : 0;
+    unsigned int bucket = hash_name(name);
+    for (hash_entry_t *e = command_hash[bucket]; e != NULL; e = e->next)
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            if (TRACING)
+                trace_event(TRACE_LOOKUP, start, name, 1);
+            return e->path;
+        }
+
+    char path[1024];
+    bool found = search_path(name, path, sizeof(path));
+    if (TRACING)
+        trace_event(TRACE_LOOKUP, start, name, 0);
+    if (!found)
+        return NULL;
+
+    if (hashed_path_env == NULL)
+        hashed_path_env = strdup(path_env);
+    hash_entry_t *e = malloc(sizeof(hash_entry_t));
+    e->name = strdup(name);
+    e->path = strdup(path);
+    e->hits = 1;
+    e->next = command_hash[bucket];
+    command_hash[bucket] = e;
+    return e->path;
+}
+
+// Reports whether name is one of the commands the shell runs itself
+int is_builtin(const char* name) {
+    const builtin_t *b = find_builtin(name);
+    return b != NULL && b->handles == NULL; // cat and tee also exist as real commands
+}
+
+// Executes a single command that is not part of a pipeline. Functions and built-in commands
+// run in the shell itself, anything else is started as a one-stage pipeline.
+void execute_command(char* tokens[]) {
+    int saved[2]; // The shell's stdin and stdout while a redirection replaces them
+    function_t *f = find_function(tokens[0]);
+    if (f != NULL) {
+        if (check_redirection(tokens, saved) == 0) {
+            call_function(f, tokens);
+            fflush(stdout);
+            restore_redirection(saved);
+        } else
+            currstatus = 0;
+    } else if (builtin_for(tokens, -1) != NULL) { // Execute built-in commands directly without forking
+        if (check_redirection(tokens, saved) == 0) { // Handle redirection if any before executing
+            execute_builtin_command(tokens); // Execute the built-in command
+            fflush(stdout); // Flush before the redirected stdout is restored
+            restore_redirection(saved);
+        } else
+            currstatus = 0;
+    } else {
+        // External commands get their redirections in the child, the shell's own fds stay put
+        long long start = now_ns();
+        pid_t pid = launch_stage(tokens, -1, -1, 0, true);
+        spawn_ns += now_ns() - start;
+        currstatus = wait_foreground(&pid, 1, pid);
+    }
+}
+
+// Starts one command of a pipeline with stdin/stdout connected to infd/outfd (-1 keeps the
+// shell's); its own '<' and '>' redirections take precedence over the pipe. The process joins
+// process group pgid, or leads a new group when pgid is 0, which gets the terminal if it
+// runs in the foreground.
+// Returns the pid of the started process, or -1 after printing why it could not be started.
+pid_t launch_stage(char* argv[], int infd, int outfd, pid_t pgid, bool foreground) {
+    redirect_t r;
+    int redir_in, redir_out;
+    collect_redirection(argv, &r);
+    if (argv[0] == NULL) {
+        fprintf(stderr, "mysh: missing command\n");
+        return -1;
+    }
+    if (open_redirection(&r, &redir_in, &redir_out) < 0)
+        return -1;
+    if (redir_in >= 0)
+        infd = redir_in;
+    if (redir_out >= 0)
+        outfd = redir_out;
+
+    pid_t pid = -1;
+    function_t *f = find_function(argv[0]);
+    if (f != NULL || builtin_for(argv, infd) != NULL) {
+        // A builtin or function inside a pipeline runs in a copy of the shell so it can write to the pipe
+        long long start = TRACING ? now_ns() : 0;
+        pid = fork();
+        if (pid == 0) { // Child process
+            trace_child();
+            enter_process_group(pgid, foreground);
+            if (infd >= 0)
+                dup2(infd, STDIN_FILENO);
+            if (outfd >= 0)
+                dup2(outfd, STDOUT_FILENO);
+            terminal_owned = false; // Commands of a function must not take the terminal from the pipeline
+            if (f != NULL)
+                call_function(f, argv);
+            else
+                execute_builtin_command(argv);
+            fflush(stdout);
+            trace_flush();
+            _exit(currstatus ? EXIT_SUCCESS : EXIT_FAILURE);
+        } else if (pid > 0) {
+            if (TRACING)
+                trace_event(TRACE_FORK, start, argv[0], pid);
+            setpgid(pid, pgid ? pgid : pid); // Also set here so the group exists when the parent continues
+        } else {
+            perror("fork");
+        }
+    } else {
+        // Bare names are resolved through the hash table, pathnames are executed directly
+        bool bare = !check_slash(argv[0]);
+        const char *path = bare ? lookup_command(argv[0]) : argv[0];
+        if (path != NULL) {
+            pid = launch_command(path, argv, infd, outfd, pgid, foreground);
+            if (pid < 0 && bare && (errno == ENOENT || errno == EACCES)) {
+                // The cached executable was removed or lost its permissions, search again
+                hash_forget(argv[0]);
+                path = lookup_command(argv[0]);
+                if (path != NULL)
+                    pid = launch_command(path, argv, infd, outfd, pgid, foreground);
+            }
+        }
+        if (path == NULL) {
+            printf("Command not found: %s\n", argv[0]);
+            fflush(stdout);
+        } else if (pid < 0) {
+            perror("execv");
+        }
+    }
+
+    if (redir_in >= 0)
+        close(redir_in);
+    if (redir_out >= 0)
+        close(redir_out);
+    return pid;
+}
+
+// Runs a pipeline of any length. Every stage is started directly inside its own child,
+// all stages share one process group, and each child is reaped by pid.
+// The status of the pipeline is the status of its last command. A background pipeline
+// reads from /dev/null unless redirected and is added to the job table instead of waited for.
+void execute_pipeline(char* tokens[], bool background) {
+    // Split the tokens into stages at every '|'
+    int nstages = 1;
+    for (int i = 0; tokens[i] != NULL; i++)
+        nstages += tokens[i] == op_pipe;
+    char ***stages = arena_alloc(&command_arena, nstages * sizeof(char**));
+    nstages = 0;
+    stages[nstages++] = tokens;
+    for (int i = 0; tokens[i] != NULL; i++)
+        if (tokens[i] == op_pipe) {
+            tokens[i] = NULL;
+            stages[nstages++] = &tokens[i + 1];
+        }
+    for (int i = 0; i < nstages; i++)
+        if (stages[i][0] == NULL) {
+            fprintf(stderr, "mysh: syntax error near '|'\n");
+            currstatus = 0;
+            return;
+        }
+
+    // With pipestats, a relay process between every two stages counts what passes through.
+    // The relays come first in procs, so that the status is still that of the last stage.
+    pipe_stats_t *stats = NULL;
+    int nmeters = 0;
+    if (pipe_stats > 0 && !background && nstages > 1) {
+        stats = mmap(NULL, (nstages - 1) * sizeof(pipe_stats_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (stats == MAP_FAILED)
+            stats = NULL;
+        else
+            nmeters = nstages - 1;
+    }
+    pid_t *procs = arena_alloc(&command_arena, (nmeters + nstages) * sizeof(pid_t));
+    pid_t *pids = procs + nmeters;
+
+    long long pipeline_start = now_ns();
+    pid_t pgid = 0;
+    int prev_read = -1; // Read end of the pipe feeding the next stage
+    if (background)
+        prev_read = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    for (int i = 0; i < nstages; i++) {
+        int p[2] = {-1, -1}, relay[2] = {-1, -1};
+        if (i < nstages - 1 && pipe2(p, O_CLOEXEC) == -1) {
+            perror("pipe");
+            p[0] = p[1] = -1;
+        }
+        if (p[0] >= 0)
+            size_pipe(p[0], background);
+
+        long long start = now_ns();
+        pids[i] = launch_stage(stages[i], prev_read, p[1], pgid, !background);
+        spawn_ns += now_ns() - start;
+        if (pids[i] > 0 && pgid == 0)
+            pgid = pids[i]; // The first started stage leads the group
+
+        // The shell keeps no pipe ends open, so every reader sees EOF once its writer exits
+        if (prev_read >= 0)
+            close(prev_read);
+        if (p[1] >= 0)
+            close(p[1]);
+        prev_read = p[0];
+
+        if (i < nmeters) {
+            procs[i] = -1;
+            if (p[0] >= 0 && pipe2(relay, O_CLOEXEC) == 0) {
+                size_pipe(relay[0], background);
+                procs[i] = start_meter(p[0], relay, pgid, &stats[i]);
+                close(p[0]);
+                close(relay[1]);
+                prev_read = relay[0];
+            }
+        }
+    }
+    if (prev_read >= 0)
+        close(prev_read);
+
+    if (background) {
+        // Only foreground commands change currstatus
+        job_t *job = add_job(pgid, pids, nstages, false);
+        if (interactive_mode) {
+            printf("[%d] %d\n", job->id, (int)pgid);
+            fflush(stdout);
+        }
+    } else {
+        currstatus = wait_foreground(procs, nmeters + nstages, pgid);
+    }
+    if (stats != NULL) {
+        report_pipe_stats(stages, nstages, stats, now_ns() - pipeline_start);
+        munmap(stats, nmeters * sizeof(pipe_stats_t));
+    }
+}
+
+// Gives a pipe between pipeline stages the buffer size chosen with setopt pipesize. In auto
+// mode only foreground pipelines get a larger buffer: the kernel shrinks every new pipe to
+// the minimum once a user's pipes hold too much, which thousands of jobs could cause.
+void size_pipe(int fd, bool background) {
+    static int auto_size = 0;
+    static bool warned = false;
+    int size = pipe_size;
+    if (size == AUTO_VALUE) {
+        if (background)
+            return;
+        if (auto_size == 0) {
+            auto_size = PIPE_AUTO_SIZE;
+            FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+            int max;
+            if (f != NULL) {
+                if (fscanf(f, "%d", &max) == 1 && max < auto_size)
+                    auto_size = max;
+                fclose(f);
+            }
+        }
+        size = auto_size;
+    }
+    if (size == 0)
+        return;
+    if (fcntl(fd, F_SETPIPE_SZ, size) < 0 && pipe_size != AUTO_VALUE && !warned) {
+        perror("mysh: pipesize"); // The pipe keeps the size it had
+        warned = true;
+    }
+}
+
+// Starts a process that relays a pipe of a pipeline from in to the pipe out and counts the
+// traffic. It joins the pipeline's process group, so that Ctrl-C and Ctrl-Z reach it too.
+pid_t start_meter(int in, int out[2], pid_t pgid, pipe_stats_t* stats) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(out[0]); // Holding the read end would keep the writer from seeing EPIPE
+        enter_process_group(pgid, false);
+        signal(SIGPIPE, SIG_IGN); // A reader that is gone shows up as EPIPE
+        meter_pipe(in, out[1], stats);
+        _exit(EXIT_SUCCESS);
+    } else if (pid > 0) {
+        setpgid(pid, pgid ? pgid : pid);
+    } else {
+        perror("fork");
+    }
+    return pid;
+}
+
+// Moves data from the pipe in to the pipe out with splice() until the writer closes in or
+// the reader closes out. It sleeps in poll() until it can move data again. A wait that
+// starts with the input pipe full is time the writer was blocked, and one that starts with
+// both pipes empty is time the reader was; either pipe stays that way until the relay moves
+// data, so those waits have no timeout and an idle pipeline costs nothing. Only while the
+// relay waits for a slow reader with the input pipe partly full can that pipe fill unseen,
+// so that wait is cut short, after 1 ms while the writer is still writing and backing off
+// to a second once it is not.
+void meter_pipe(int in, int out, pipe_stats_t* stats) {
+    int in_room = fcntl(in, F_GETPIPE_SZ), out_room = fcntl(out, F_GETPIPE_SZ);
+    int backoff = 1, last_queued = -1;
+    while (1) {
+        ssize_t n = splice(in, NULL, out, NULL, out_room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            stats->bytes += n;
+            continue;
+        }
+        if (n == 0 || errno != EAGAIN)
+            break; // The writer finished, or the reader is gone
+
+        int queued_in = 0, queued_out = 0;
+        ioctl(in, FIONREAD, &queued_in);
+        ioctl(out, FIONREAD, &queued_out);
+        int timeout = -1;
+        if (queued_in > 0 && queued_in <= in_room - PIPE_BUF) {
+            backoff = queued_in != last_queued ? 1 : backoff < 1000 ? backoff * 2 : 1000;
+            timeout = backoff;
+        }
+        last_queued = queued_in;
+
+        // Waiting for input, out is watched too: POLLERR there means the reader is gone
+        struct pollfd p[2] = {{queued_in > 0 ? out : in, queued_in > 0 ? POLLOUT : POLLIN, 0}, {out, 0, 0}};
+        long long start = now_ns();
+        if (poll(p, queued_in > 0 ? 1 : 2, timeout) < 0 && errno != EINTR)
+            break;
+        long long waited = now_ns() - start;
+        if (queued_in == 0 && (p[1].revents & POLLERR))
+            break;
+        if (queued_in > in_room - PIPE_BUF)
+            stats->writer_blocked_ns += waited;
+        else if (queued_in == 0 && queued_out == 0)
+            stats->reader_blocked_ns += waited;
+    }
+}
+
+// Prints the counters of every pipe of a pipeline to stderr, with the rate over the
+// pipeline's run time
+void report_pipe_stats(char** stages[], int nstages, pipe_stats_t* stats, long long real_ns) {
+    double seconds = real_ns / 1e9;
+    for (int i = 0; i < nstages - 1; i++)
+        fprintf(stderr, "mysh: pipe %d (%s | %s): %llu bytes, %.1f MB/s, writer blocked %.3f s, reader blocked %.3f s\n",
+                i + 1, stages[i][0], stages[i + 1][0], stats[i].bytes,
+                seconds > 0 ? stats[i].bytes / 1e6 / seconds : 0.0,
+                stats[i].writer_blocked_ns / 1e9, stats[i].reader_blocked_ns / 1e9);
+}
+
+// Reports whether a pattern component contains an unescaped wildcard character
+int has_wildcard(const char* pattern) {
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        else if (*p == '*' || *p == '?' || *p == '[')
+            return 1;
+    }
+    return 0;
+}
+
+// Matches c against the bracket expression starting after '[' at *pattern, advancing
+// *pattern past the closing ']'. Returns -1 if the expression is not terminated.
+int match_bracket(const char** pattern, char c) {
+    const char *p = *pattern;
+    bool negate = false, matched = false;
+    if (*p == '!' || *p == '^') {
+        negate = true;
+        p++;
+    }
+    bool first = true; // A ']' right after the opening bracket is literal
+    while (*p != ']' || first) {
+        if (*p == '\0')
+            return -1;
+        first = false;
+        char lo = *p;
+        if (lo == '\\' && p[1] != '\0')
+            lo = *++p;
+        char hi = lo;
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') { // Range such as a-z
+            p += 2;
+            hi = *p;
+            if (hi == '\\' && p[1] != '\0')
+                hi = *++p;
+        }
+        if ((unsigned char)c >= (unsigned char)lo && (unsigned char)c <= (unsigned char)hi)
+            matched = true;
+        p++;
+    }
+    *pattern = p + 1;
+    return matched != negate;
+}
+
+// Matches a file name against one wildcard pattern component supporting '*', '?',
+// '[...]' (with ranges and '!' or '^' negation) and '\' escapes.
+// Runs in linear time for the common cases by only backtracking to the last '*'.
+// Returns 1 on a match.
+int match_pattern(const char* pattern, const char* name) {
+    const char *star = NULL;     // Pattern position just after the last '*' seen
+    const char *star_name = NULL; // Name position that '*' currently extends to
+
+    while (*name != '\0') {
+        if (*pattern == '*') {
+            while (*pattern == '*')
+                pattern++;
+            if (*pattern == '\0')
+                return 1; // A trailing '*' matches the rest of the name
+            star = pattern;
+            star_name = name;
+            continue;
+        }
+
+        int ok;
+        const char *next = pattern + 1;
+        if (*pattern == '?') {
+            ok = 1;
+        } else if (*pattern == '[') {
+            ok = match_bracket(&next, *name);
+            if (ok < 0) { // No closing bracket, so '[' is an ordinary character
+                ok = *name == '[';
+                next = pattern + 1;
+            }
+        } else if (*pattern == '\\' && pattern[1] != '\0') {
+            ok = pattern[1] == *name;
+            next = pattern + 2;
+        } else {
+            ok = *pattern != '\0' && *pattern == *name;
+        }
+
+        if (ok) {
+            pattern = next;
+            name++;
+        } else if (star != NULL) {
+            // Let the last '*' swallow one more character and retry from there
+            pattern = star;
+            name = ++star_name;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+// Copies a pattern component with its escapes removed
+char *unescape_pattern(arena_t* arena, const char* pattern, size_t len) {
+    char *plain = arena_alloc(arena, len + 1);
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (pattern[i] == '\\' && i + 1 < len)
+            i++;
+        plain[n++] = pattern[i];
+    }
+    plain[n] = '\0';
+    return plain;
+}
+
+// Joins a directory and a name ("" stands for the current directory)
+char *join_path(arena_t* arena, const char* dir, const char* name, size_t namelen) {
+    size_t dirlen = strlen(dir);
+    bool slash = dirlen > 0 && dir[dirlen - 1] != '/';
+    char *path = arena_alloc(arena, dirlen + slash + namelen + 1);
+    memcpy(path, dir, dirlen);
+    if (slash)
+        path[dirlen] = '/';
+    memcpy(path + dirlen + slash, name, namelen);
+    path[dirlen + slash + namelen] = '\0';
+    return path;
+}
+
+// Decides from a directory entry whether it is a directory (want_dir) or a regular file.
+// The type comes from d_type; stat is only needed when it is unknown or a symbolic link.
+int entry_has_type(DIR* d, struct dirent* entry, bool want_dir) {
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat sbuf;
+        if (fstatat(dirfd(d), entry->d_name, &sbuf, 0) != 0)
+            return 0;
+        return want_dir ? S_ISDIR(sbuf.st_mode) : S_ISREG(sbuf.st_mode);
+    }
+    return want_dir ? type == DT_DIR : type == DT_REG;
+}
+
+// Matches found by one wildcard expansion, or by one thread of a '**' walk
+typedef struct {
+    arena_t *arena;  // Where paths and the match array are allocated
+    char **matches;  // Matched paths, in the order they were found
+    int count;       // Number of matches
+    int capacity;    // Size of the matches array
+    bool dir_only;   // The pattern ended in '/', so the last component matches directories
+    bool nested;     // Running inside a '**' walk, which does not start more threads
+} glob_state_t;
+
+// Records a matched path
+void add_match(glob_state_t* g, char* path) {
+    if (g->count == g->capacity) {
+        int capacity = g->capacity ? g->capacity * 2 : 64;
+        char **matches = arena_alloc(g->arena, capacity * sizeof(char*));
+        if (g->count > 0)
+            memcpy(matches, g->matches, g->count * sizeof(char*));
+        g->matches = matches;
+        g->capacity = capacity;
+    }
+    g->matches[g->count++] = path;
+}
+
+void glob_walk(glob_state_t* g, const char* dir, const char* rest);
+
+// Expands the pattern components starting at pattern inside directory dir ("" for the
+// current directory). Directory components only match directories and the last component
+// only matches regular files, as in the original single-directory expansion. A component
+// that is exactly '**' matches any number of directories.
+void glob_dir(glob_state_t* g, const char* dir, const char* pattern) {
+    while (*pattern == '/')
+        pattern++;
+    const char *end = strchr(pattern, '/');
+    size_t complen = end ? (size_t)(end - pattern) : strlen(pattern);
+    const char *rest = end;
+    while (rest != NULL && *rest == '/')
+        rest++;
+    bool last = rest == NULL || *rest == '\0';
+
+    if (complen == 2 && pattern[0] == '*' && pattern[1] == '*') {
+        glob_walk(g, dir, last ? "" : rest);
+        return;
+    }
+
+    char *component = arena_strndup(g->arena, pattern, complen);
+    if (!has_wildcard(component)) {
+        // A literal component needs no directory listing
+        char *plain = unescape_pattern(g->arena, component, complen);
+        char *path = join_path(g->arena, dir, plain, strlen(plain));
+        if (!last) {
+            glob_dir(g, path, rest);
+        } else {
+            struct stat sbuf;
+            if (stat(path, &sbuf) == 0 && (g->dir_only ? S_ISDIR(sbuf.st_mode) : S_ISREG(sbuf.st_mode)))
+                add_match(g, g->dir_only ? join_path(g->arena, path, "", 0) : path);
+        }
+        return;
+    }
+
+    DIR *d = opendir(dir[0] != '\0' ? dir : ".");
+    if (d == NULL)
+        return;
+    bool want_dir = !last || g->dir_only;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        // Hidden files only match a pattern that starts with a literal dot
+        if (name[0] == '.' && component[0] != '.')
+            continue;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        // The name is tested before anything is allocated or stat'ed for it
+        if (!match_pattern(component, name) || !entry_has_type(d, entry, want_dir))
+            continue;
+
+        char *path = join_path(g->arena, dir, name, strlen(name));
+        if (!last)
+            glob_dir(g, path, rest);
+        else
+            add_match(g, g->dir_only ? join_path(g->arena, path, "", 0) : path);
+    }
+    closedir(d);
+}
+
+// Directories waiting to be listed by one walker thread. The owner pushes and pops at the
+// back (depth first); idle threads steal from the front, where the larger subtrees are.
+typedef struct {
+    pthread_mutex_t lock;
+    char **items;  // Directory paths relative to the walk root
+    int head;      // Index of the oldest item
+    int tail;      // Index one past the newest item
+    int capacity;  // Size of items
+} walk_queue_t;
+
+// A recursive '**' expansion shared by all of its threads
+typedef struct {
+    int rootfd;          // Directory the walk starts from
+    const char *root;    // Its path as written in the pattern ("" for the current directory)
+    const char *rest;    // Pattern components after '**' ("" when '**' is last)
+    char *first;         // First of those components
+    bool first_last;     // Whether it is also the last one
+    int nthreads;        // Number of walker threads
+    walk_queue_t *queues;
+    int pending;         // Directories queued or being listed; the walk ends at zero
+    pthread_mutex_t idle_lock;
+    pthread_cond_t wake; // Signalled when a directory is queued or the walk ends
+    int sleepers;        // Threads waiting on wake, found without taking idle_lock
+} walk_t;
+
+// One thread of a walk and the matches it found
+typedef struct {
+    walk_t *walk;
+    int id;
+    glob_state_t g;
+    arena_t arena;
+} walker_t;
+
+// Queues a directory on a walker's own queue
+void walk_push(walk_t* walk, int id, char* item) {
+    walk_queue_t *q = &walk->queues[id];
+    __atomic_add_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->capacity) {
+        // Slide the live items to the front, growing the array when it is mostly full
+        int live = q->tail - q->head;
+        if (live * 2 >= q->capacity) {
+            q->capacity = q->capacity ? q->capacity * 2 : 256;
+            char **items = malloc(q->capacity * sizeof(char*));
+            if (live > 0)
+                memcpy(items, q->items + q->head, live * sizeof(char*));
+            free(q->items);
+            q->items = items;
+        } else {
+            memmove(q->items, q->items + q->head, live * sizeof(char*));
+        }
+        q->head = 0;
+        q->tail = live;
+    }
+    q->items[q->tail++] = item;
+    pthread_mutex_unlock(&q->lock);
+
+    // The fence orders the push before the check, against the sleeper's check of the queues
+    // after it counted itself, so that one of the two sees the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&walk->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_signal(&walk->wake);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+}
+
+// Takes the newest directory from the walker's own queue, or the oldest one of another queue
+char *walk_pop(walk_t* walk, int id) {
+    for (int i = 0; i < walk->nthreads; i++) {
+        walk_queue_t *q = &walk->queues[(id + i) % walk->nthreads];
+        char *item = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail)
+            item = i == 0 ? q->items[--q->tail] : q->items[q->head++];
+        pthread_mutex_unlock(&q->lock);
+        if (item != NULL)
+            return item;
+    }
+    return NULL;
+}
+
+// Lists one directory of a walk: subdirectories are queued, and entries are matched
+// against the components after '**' in the same pass over the directory.
+void walk_directory(walker_t* w, const char* rel) {
+    walk_t *walk = w->walk;
+    int fd = openat(walk->rootfd, rel[0] != '\0' ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    DIR *d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        size_t namelen = strlen(name);
+        char *relpath = NULL;
+
+        // Descend into every directory that is not hidden; symbolic links are not followed
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat sbuf;
+            is_dir = fstatat(fd, name, &sbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sbuf.st_mode);
+        }
+        if (is_dir && name[0] != '.') {
+            relpath = join_path(w->g.arena, rel, name, namelen);
+            walk_push(walk, w->id, relpath);
+        }
+
+        // A trailing '**' matches every file below the root, otherwise test the next component
+        bool matched;
+        if (walk->first == NULL)
+            matched = name[0] != '.';
+        else
+            matched = (name[0] != '.' || walk->first[0] == '.') && match_pattern(walk->first, name);
+        if (!matched)
+            continue;
+        bool last = walk->first == NULL || walk->first_last;
+        if (!entry_has_type(d, entry, !last || w->g.dir_only))
+            continue;
+
+        if (relpath == NULL)
+            relpath = join_path(w->g.arena, rel, name, namelen);
+        char *path = walk->root[0] != '\0' ? join_path(w->g.arena, walk->root, relpath, strlen(relpath)) : relpath;
+        if (!last) {
+            const char *after = strchr(walk->rest, '/');
+            glob_dir(&w->g, path, after);
+        } else {
+            add_match(&w->g, w->g.dir_only ? join_path(w->g.arena, path, "", 0) : path);
+        }
+    }
+    closedir(d);
+}
+
+// Thread body: lists directories until none are queued or being listed by anyone. A thread
+// that finds no work while others are still listing sleeps until more is queued.
+void *walker_main(void* arg) {
+    walker_t *w = arg;
+    walk_t *walk = w->walk;
+    while (1) {
+        char *rel = walk_pop(walk, w->id);
+        if (rel == NULL) {
+            pthread_mutex_lock(&walk->idle_lock);
+            __atomic_add_fetch(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+            while ((rel = walk_pop(walk, w->id)) == NULL && __atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0)
+                pthread_cond_wait(&walk->wake, &walk->idle_lock);
+            __atomic_sub_fetch(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&walk->idle_lock);
+            if (rel == NULL)
+                break;
+        }
+        walk_directory(w, rel);
+        if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&walk->idle_lock); // The walk is over, let the sleepers go
+            pthread_cond_broadcast(&walk->wake);
+            pthread_mutex_unlock(&walk->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+// Expands '**' below dir followed by the components in rest. The directory tree is walked by
+// glob_threads threads that share work by stealing queued directories. Each thread keeps its
+// own matches and arena, and the caller sorts the combined matches, so the result does not
+// depend on the number of threads or on scheduling.
+void glob_walk(glob_state_t* g, const char* dir, const char* rest) {
+    walk_t walk;
+    walk.rootfd = open(dir[0] != '\0' ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walk.rootfd < 0)
+        return;
+    walk.root = dir;
+    walk.rest = rest;
+    walk.first = NULL;
+    walk.first_last = true;
+    if (rest[0] != '\0') {
+        const char *end = strchr(rest, '/');
+        walk.first = arena_strndup(g->arena, rest, end ? (size_t)(end - rest) : strlen(rest));
+        walk.first_last = end == NULL || end[strspn(end, "/")] == '\0';
+    }
+    // A walk inside a walk runs on the thread that found it
+    walk.nthreads = 1;
+    if (!g->nested)
+        walk.nthreads = glob_threads == AUTO_VALUE ? (int)sysconf(_SC_NPROCESSORS_ONLN) : glob_threads;
+    if (walk.nthreads < 1)
+        walk.nthreads = 1;
+    walk.pending = 0;
+    walk.sleepers = 0;
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.wake, NULL);
+    walk.queues = calloc(walk.nthreads, sizeof(walk_queue_t));
+    walker_t *walkers = calloc(walk.nthreads, sizeof(walker_t));
+    pthread_t *threads = malloc(walk.nthreads * sizeof(pthread_t));
+
+    for (int i = 0; i < walk.nthreads; i++) {
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+        walkers[i].walk = &walk;
+        walkers[i].id = i;
+        walkers[i].g.arena = &walkers[i].arena;
+        walkers[i].g.dir_only = g->dir_only;
+        walkers[i].g.nested = true;
+    }
+    walk_push(&walk, 0, "");
+
+    int started = 1;
+    for (; started < walk.nthreads; started++)
+        if (pthread_create(&threads[started], NULL, walker_main, &walkers[started]) != 0)
+            break;
+    walker_main(&walkers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    // Hand the matches and the memory holding them over to the caller
+    for (int i = 0; i < walk.nthreads; i++) {
+        for (int j = 0; j < walkers[i].g.count; j++)
+            add_match(g, walkers[i].g.matches[j]);
+        arena_adopt(g->arena, &walkers[i].arena);
+        pthread_mutex_destroy(&walk.queues[i].lock);
+        free(walk.queues[i].items);
+    }
+    free(threads);
+    free(walkers);
+    free(walk.queues);
+    pthread_cond_destroy(&walk.wake);
+    pthread_mutex_destroy(&walk.idle_lock);
+    close(walk.rootfd);
+}
+
+// Orders matched paths bytewise for qsort
+int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Expands a wildcard pattern to the matching file names, appending them to tokens in
+// sorted order, however many there are. Every '/' separated component may contain '*', '?' and '[...]', and a
+// '**' component matches any depth of directories.
+// Returns the count of matched files.
+int check_wildcard(char* token, words_t* tokens) {
+    glob_state_t g;
+    memset(&g, 0, sizeof(g));
+    g.arena = &command_arena;
+    size_t len = strlen(token);
+    g.dir_only = len > 0 && token[len - 1] == '/';
+
+    glob_dir(&g, token[0] == '/' ? "/" : "", token);
+
+    qsort(g.matches, g.count, sizeof(char*), compare_paths);
+    for (int i = 0; i < g.count; i++)
+        words_push(tokens, g.matches[i]);
+    return g.count;
+}
+
+// Parses a setting value: "auto", or a non-negative number with an optional k or m suffix.
+// Returns 0 on success, or -1 if the text is not a valid value.
+int parse_option_value(const char* text, int* value) {
+    if (strcmp(text, "auto") == 0) {
+        *value = AUTO_VALUE;
+        return 0;
+    }
+    char *end;
+    long n = strtol(text, &end, 10);
+    if (end == text || n < 0)
+        return -1;
+    if (*end == 'k' || *end == 'K')
+        n *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        n *= 1024 * 1024, end++;
+    if (*end != '\0' || n > 0x7fffffff)
+        return -1;
+    *value = (int)n;
+    return 0;
+}
+
+// Change directory with 'cd'
+void builtin_cd(char* tokens[]) {
+    if (tokens[1] != NULL) {
+        if (chdir(tokens[1]) != 0) {
+            perror("cd"); // Print error if change directory fails
+            currstatus = 0;
+        } else
+            currstatus = 1;
+    } else {
+        fprintf(stderr, "cd: missing argument\n"); // No directory specified
+        currstatus = 0;
+    }
+}
+
+// Print the current working directory with 'pwd'
+void builtin_pwd(char* tokens[]) {
+    char cwd[1024]; // Buffer for the current working directory
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        printf("%s\n", cwd); // Print the current directory
+        currstatus = 1;
+    } else {
+        perror("pwd"); // Print error if getting current directory fails
+        currstatus = 0;
+    }
+}
+
+// Check if a command exists in PATH with 'which'
+void builtin_which(char* tokens[]) {
+    if (tokens[1] == NULL || tokens[2] != NULL || is_builtin(tokens[1])) {
+        fprintf(stderr, "which: incorrect arguments\n");
+        currstatus = 0;
+    } else {
+        char cmd_path[1024]; // Buffer for command path
+        if (search_path(tokens[1], cmd_path, sizeof(cmd_path))) {
+            printf("%s\n", cmd_path); // Command found in PATH
+            currstatus = 1;
+        } else {
+            fprintf(stderr, "which: no command found in PATH\n");
+            currstatus = 0;
+        }
+    }
+}
+
+// Show or reset the executable lookup cache with 'hash'
+void builtin_hash(char* tokens[]) {
+    currstatus = 1;
+    if (tokens[1] == NULL) { // List the cached commands like bash does
+        bool empty = true;
+        for (int i = 0; i < HASH_BUCKETS; i++)
+            for (hash_entry_t *e = command_hash[i]; e != NULL; e = e->next) {
+                if (empty)
+                    printf("hits\tcommand\n");
+                printf("%4d\t%s\n", e->hits, e->path);
+                empty = false;
+            }
+        if (empty)
+            printf("hash: hash table empty\n");
+    } else if (strcmp(tokens[1], "-r") == 0) { // Forget every remembered location
+        hash_flush();
+    } else { // Resolve and remember each given name
+        for (int i = 1; tokens[i] != NULL; i++)
+            if (check_slash(tokens[i]) || lookup_command(tokens[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", tokens[i]);
+                currstatus = 0;
+            }
+    }
+}
+
+// Show or change a tunable setting with 'setopt [name [value]]'
+void builtin_setopt(char* tokens[]) {
+    currstatus = 1;
+    for (shell_option_t *opt = shell_options; opt->name != NULL; opt++) {
+        if (tokens[1] != NULL && strcmp(tokens[1], opt->name) != 0)
+            continue;
+        if (tokens[1] != NULL && tokens[2] != NULL) {
+            if (parse_option_value(tokens[2], opt->value) < 0) {
+                fprintf(stderr, "setopt: %s: invalid value '%s'\n", opt->name, tokens[2]);
+                currstatus = 0;
+            }
+            return;
+        }
+        if (*opt->value == AUTO_VALUE)
+            printf("%-12s auto\t# %s\n", opt->name, opt->description);
+        else
+            printf("%-12s %d\t# %s\n", opt->name, *opt->value, opt->description);
+        if (tokens[1] != NULL)
+            return;
+    }
+    if (tokens[1] != NULL) {
+        fprintf(stderr, "setopt: %s: unknown setting\n", tokens[1]);
+        currstatus = 0;
+    }
+}
+
+// Exports variables to the commands the shell runs: export NAME[=VALUE]... Without
+// arguments, lists the exported variables sorted by name.
+void builtin_export(char* tokens[]) {
+    currstatus = 1;
+    if (tokens[1] == NULL) {
+        char **names = arena_alloc(&command_arena, (variable_count + 1) * sizeof(char*));
+        int n = 0;
+        for (int i = 0; i < variable_capacity; i++)
+            if (variables[i].name != NULL && variables[i].exported && variables[i].value != NULL)
+                names[n++] = variables[i].name;
+        qsort(names, n, sizeof(char*), compare_paths);
+        for (int i = 0; i < n; i++)
+            printf("export %s=%s\n", names[i], get_variable(names[i]));
+        return;
+    }
+    for (int i = 1; tokens[i] != NULL; i++) {
+        if (is_assignment(tokens[i])) {
+            assign_variable(tokens[i], true);
+            continue;
+        }
+        const char *p = tokens[i];
+        while (isalnum((unsigned char)*p) || *p == '_')
+            p++;
+        if (*p != '\0' || isdigit((unsigned char)tokens[i][0]) || tokens[i][0] == '\0') {
+            fprintf(stderr, "export: %s: not a valid name\n", tokens[i]);
+            currstatus = 0;
+            continue;
+        }
+        variable_t *v = find_variable(tokens[i], p - tokens[i]);
+        if (v != NULL && !v->exported) { // An unset name is not exported until it is set
+            v->exported = true;
+            environ_stale = true;
+        }
+    }
+}
+
+// Removes shell and environment variables with 'unset NAME...'
+void builtin_unset(char* tokens[]) {
+    for (int i = 1; tokens[i] != NULL; i++)
+        unset_variable(tokens[i]);
+    currstatus = 1;
+}
+
+// List background and stopped jobs with 'jobs'
+void builtin_jobs(char* tokens[]) {
+    reap_jobs(0);
+    for (int i = 0; i < njobs; i++) {
+        print_job(jobs[i]);
+        if (jobs[i]->running == 0)
+            remove_job(jobs[i--]); // Finished jobs are reported once
+    }
+    currstatus = 1;
+}
+
+// Wait for jobs with 'wait [%n|pid ...]'; without arguments it waits for all of them
+void builtin_wait(char* tokens[]) {
+    currstatus = 1;
+    if (tokens[1] == NULL) {
+        while (njobs > 0) {
+            wait_job(jobs[0]);
+            remove_job(jobs[0]);
+        }
+    }
+    for (int i = 1; tokens[i] != NULL; i++) {
+        job_t *job = NULL;
+        if (tokens[i][0] == '%') {
+            job = find_job(tokens[i]);
+        } else { // A process id stands for the job containing it
+            pid_t pid = atoi(tokens[i]);
+            for (int j = 0; j < njobs && job == NULL; j++)
+                for (int k = 0; k < jobs[j]->nprocs; k++)
+                    if (jobs[j]->procs[k].pid == pid && pid > 0)
+                        job = jobs[j];
+        }
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", tokens[i]);
+            currstatus = 0;
+            continue;
+        }
+        wait_job(job);
+        currstatus = job->status;
+        remove_job(job);
+    }
+}
+
+// Continue a job in the foreground with 'fg [%n]'
+void builtin_fg(char* tokens[]) {
+    job_t *job = find_job(tokens[1]);
+    if (job == NULL) {
+        fprintf(stderr, "fg: %s: no such job\n", tokens[1] ? tokens[1] : "current");
+        currstatus = 0;
+        return;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    if (terminal_owned)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    kill(-job->pgid, SIGCONT);
+    job->stopped = false;
+
+    // Wait for it like any foreground pipeline; it may be stopped again
+    pid_t pids[job->nprocs];
+    int n = 0;
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid > 0) {
+            pids[n++] = job->procs[i].pid;
+            if (job->procs[i].pidfd >= 0)
+                close(job->procs[i].pidfd);
+            else
+                unwatched_procs--;
+            job->procs[i].pidfd = -1;
+        }
+    int status = job->running > 0 && n > 0 ? -1 : job->status;
+    pid_t pgid = job->pgid;
+    remove_job(job);
+    currstatus = status >= 0 ? status : wait_foreground(pids, n, pgid);
+}
+
+// Send a signal with 'kill [-SIGNAL] %n|pid ...'
+void builtin_kill(char* tokens[]) {
+    int sig = SIGTERM, first = 1;
+    if (tokens[1] != NULL && tokens[1][0] == '-') {
+        sig = parse_signal(strcmp(tokens[1], "-s") == 0 && tokens[2] ? tokens[++first] + 0 : tokens[1] + 1);
+        first++;
+    }
+    currstatus = 1;
+    if (sig < 0 || tokens[first] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-SIGNAL] %%job|pid ...\n");
+        currstatus = 0;
+        return;
+    }
+    for (int i = first; tokens[i] != NULL; i++) {
+        int result;
+        if (tokens[i][0] == '%') {
+            job_t *job = find_job(tokens[i]);
+            if (job == NULL) {
+                fprintf(stderr, "kill: %s: no such job\n", tokens[i]);
+                currstatus = 0;
+                continue;
+            }
+            result = kill(-job->pgid, sig);
+            if (result == 0 && job->stopped && sig != SIGCONT && sig != SIGSTOP)
+                kill(-job->pgid, SIGCONT); // A stopped job has to run to act on the signal
+        } else {
+            result = kill(atoi(tokens[i]), sig);
+        }
+        if (result != 0) {
+            fprintf(stderr, "kill: %s: %s\n", tokens[i], strerror(errno));
+            currstatus = 0;
+        }
+    }
+}
+
+// Exit the shell with 'exit'
+void builtin_exit(char* tokens[]) {
+    printf("Exiting mysh\n");
+    exit(EXIT_SUCCESS);
+}
+
+// batch [-j N] COMMAND [ARGS... --] ITEMS... runs COMMAND on the items in as few calls as
+// ARG_MAX allows, like xargs but without starting it, with up to N calls at a time (one per
+// CPU by default). ARGS before -- are passed to every call; without --, every argument
+// after COMMAND is an item. The calls share the process group of a copy of the shell that
+// starts and reaps them, so Ctrl-C and Ctrl-Z reach all of them. Succeeds if every call did.
+void builtin_batch(char* tokens[]) {
+    int first = 1, njobs = AUTO_VALUE;
+    if (tokens[1] != NULL && strncmp(tokens[1], "-j", 2) == 0) {
+        const char *value = tokens[1][2] != '\0' ? tokens[1] + 2 : tokens[2];
+        if (value == NULL || parse_option_value(value, &njobs) != 0 || njobs == 0) {
+            fprintf(stderr, "batch: invalid -j value: %s\n", value != NULL ? value : "");
+            currstatus = 0;
+            return;
+        }
+        first = tokens[1][2] != '\0' ? 2 : 3;
+    }
+    if (tokens[first] == NULL) {
+        fprintf(stderr, "usage: batch [-j N] COMMAND [ARGS... --] ITEMS...\n");
+        currstatus = 0;
+        return;
+    }
+    if (njobs == AUTO_VALUE)
+        njobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    char **fixed = tokens + first, **items = NULL;
+    int nfixed = 1;
+    for (int i = 1; fixed[i] != NULL; i++)
+        if (strcmp(fixed[i], "--") == 0) {
+            nfixed = i;
+            items = fixed + i + 1;
+            break;
+        }
+    if (items == NULL)
+        items = fixed + 1;
+
+    const char *path = check_slash(fixed[0]) ? fixed[0] : lookup_command(fixed[0]);
+    if (path == NULL) {
+        printf("Command not found: %s\n", fixed[0]);
+        currstatus = 0;
+        return;
+    }
+
+    // What the kernel counts against ARG_MAX: every string, its pointer, and the environment.
+    // 2048 bytes are left over, as POSIX recommends for xargs.
+    long room = sysconf(_SC_ARG_MAX) - 2048 - (long)sizeof(char*);
+    update_environ();
+    for (char **e = environ; *e != NULL; e++)
+        room -= strlen(*e) + 1 + sizeof(char*);
+    for (int i = 0; i < nfixed; i++)
+        room -= strlen(fixed[i]) + 1 + sizeof(char*);
+
+    fflush(stdout);
+    pid_t leader = fork();
+    if (leader == 0) {
+        enter_process_group(0, true);
+        _exit(run_batch(path, fixed, nfixed, items, njobs, room));
+    }
+    if (leader < 0) {
+        perror("fork");
+        currstatus = 0;
+        return;
+    }
+    setpgid(leader, leader);
+    currstatus = wait_foreground(&leader, 1, leader);
+}
+
+// Runs the calls of a batch in the process group of the calling copy of the shell, keeping
+// up to njobs of them running. Each call gets the fixed arguments and as many items as fit
+// in room bytes, but at least one. Returns the exit status for the whole batch.
+int run_batch(const char* path, char* fixed[], int nfixed, char* items[], int njobs, long room) {
+    int nitems = 0;
+    while (items[nitems] != NULL)
+        nitems++;
+    char **argv = malloc((nfixed + nitems + 1) * sizeof(char*));
+    memcpy(argv, fixed, nfixed * sizeof(char*));
+
+    int next = 0, running = 0, status = EXIT_SUCCESS;
+    bool started = false;
+    while (next < nitems || running > 0 || !started) {
+        if ((next < nitems || !started) && running < njobs) {
+            // posix_spawn has copied the arguments once it returns, so argv is reused
+            int argc = nfixed;
+            long used = 0;
+            while (next < nitems) {
+                long size = strlen(items[next]) + 1 + sizeof(char*);
+                if (argc > nfixed && used + size > room)
+                    break;
+                used += size;
+                argv[argc++] = items[next++];
+            }
+            argv[argc] = NULL;
+            started = true;
+            pid_t pid = launch_command(path, argv, -1, -1, getpid(), false);
+            if (pid < 0) {
+                perror(fixed[0]);
+                status = EXIT_FAILURE;
+                if (running == 0)
+                    break;
+            } else {
+                running++;
+            }
+            continue;
+        }
+        int wstatus;
+        if (wait(&wstatus) < 0)
+            break;
+        running--;
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+            status = EXIT_FAILURE;
+    }
+    free(argv);
+    return status;
+}
+
+// Leaves the innermost n loops (break [n]); with next, the last of them continues with its
+// next pass instead (continue [n])
+void jump_loops(char* tokens[], bool next) {
+    int n = tokens[1] != NULL ? atoi(tokens[1]) : 1;
+    if (loop_depth == 0 || n < 1) {
+        fprintf(stderr, "%s: %s\n", tokens[0], loop_depth == 0 ? "only meaningful in a loop" : "loop count out of range");
+        currstatus = 0;
+        return;
+    }
+    loop_jump = n < loop_depth ? n : loop_depth;
+    jump_continue = next;
+    currstatus = 1;
+}
+
+// break [n]
+void builtin_break(char* tokens[]) {
+    jump_loops(tokens, false);
+}
+
+// continue [n]
+void builtin_continue(char* tokens[]) {
+    jump_loops(tokens, true);
+}
+
+// return [n] leaves the current function, with status n (0 is success) or that of the last command
+void builtin_return(char* tokens[]) {
+    if (function_depth == 0) {
+        fprintf(stderr, "return: can only return from a function\n");
+        currstatus = 0;
+        return;
+    }
+    if (tokens[1] != NULL)
+        currstatus = atoi(tokens[1]) == 0;
+    function_return = true;
+}
+
+// Writes the character for a backslash escape at *s (just after the backslash) and advances
+// *s past it. Handles the escapes of echo -e and printf. Returns 0 for \c, which ends output.
+int put_escape(const char** s) {
+    const char *p = *s;
+    int c = *p++;
+    switch (c) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'e': c = 27; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case 'c': *s = p; return 0;
+    case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+        // Octal value of up to three digits, after an optional leading 0
+        int value = 0, digits = 0;
+        p--;
+        if (*p == '0')
+            p++;
+        while (digits < 3 && *p >= '0' && *p <= '7')
+            value = value * 8 + (*p++ - '0'), digits++;
+        c = value;
+        break;
+    }
+    case 'x': {
+        int value = 0, digits = 0;
+        while (digits < 2 && isxdigit((unsigned char)*p)) {
+            value = value * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+            p++, digits++;
+        }
+        if (digits == 0) { // Not an escape after all
+            putchar('\\');
+            c = 'x';
+        } else {
+            c = value;
+        }
+        break;
+    }
+    case '\\': break;
+    case '\0': // A backslash at the end stays as it is
+        putchar('\\');
+        *s = p - 1;
+        return 1;
+    default:
+        putchar('\\');
+        break;
+    }
+    putchar(c);
+    *s = p;
+    return 1;
+}
+
+// Print the arguments with 'echo [-neE] args...'
+void builtin_echo(char* tokens[]) {
+    bool newline = true, escapes = false;
+    int i = 1;
+    // Leading words made only of n, e and E letters are options, like /bin/echo
+    for (; tokens[i] != NULL && tokens[i][0] == '-' && tokens[i][1] != '\0'; i++) {
+        if (strspn(tokens[i] + 1, "neE") != strlen(tokens[i] + 1))
+            break;
+        for (const char *o = tokens[i] + 1; *o != '\0'; o++) {
+            if (*o == 'n')
+                newline = false;
+            else
+                escapes = *o == 'e';
+        }
+    }
+    for (int first = i; tokens[i] != NULL; i++) {
+        if (i > first)
+            putchar(' ');
+        if (!escapes) {
+            fputs(tokens[i], stdout);
+            continue;
+        }
+        for (const char *p = tokens[i]; *p != '\0';) {
+            if (*p != '\\') {
+                putchar(*p++);
+                continue;
+            }
+            p++;
+            if (!put_escape(&p))
+                return; // \c suppresses everything that follows
+        }
+    }
+    if (newline)
+        putchar('\n');
+    currstatus = 1;
+}
+
+// Converts a printf argument to a number; a leading quote gives the value of the next character
+long long printf_number(const char* arg) {
+    if (arg[0] == '\'' || arg[0] == '"')
+        return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        currstatus = 0;
+    }
+    return n;
+}
+
+// Format and print arguments with 'printf format [args...]'. The format is reused while
+// arguments remain, and missing arguments count as empty strings or zero.
+void builtin_printf(char* tokens[]) {
+    if (tokens[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        currstatus = 0;
+        return;
+    }
+    currstatus = 1;
+    const char *format = tokens[1];
+    char **args = tokens + 2;
+    do {
+        bool consumed = false;
+        for (const char *p = format; *p != '\0';) {
+            if (*p == '\\') {
+                p++;
+                if (!put_escape(&p))
+                    return;
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p++);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p += 2;
+                continue;
+            }
+
+            // Copy the conversion with its flags, width and precision into spec
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 40)
+                spec[n++] = *p++;
+            while (*p != '\0' && (isdigit((unsigned char)*p) || *p == '.') && n < 60)
+                spec[n++] = *p++;
+            char conv = *p;
+            if (conv == '\0' || strchr("sbcdiouxXfFeEgG", conv) == NULL) {
+                fprintf(stderr, "printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+                currstatus = 0;
+                return;
+            }
+            p++;
+            const char *arg = *args != NULL ? *args++ : NULL;
+            consumed |= arg != NULL;
+
+            if (conv == 'b') { // A string with its backslash escapes expanded
+                for (const char *a = arg ? arg : ""; *a != '\0';) {
+                    if (*a != '\\') {
+                        putchar(*a++);
+                        continue;
+                    }
+                    a++;
+                    if (!put_escape(&a))
+                        return;
+                }
+            } else if (conv == 's' || conv == 'c') {
+                // %c prints the first character as a string, so an empty argument writes no NUL
+                char first[2] = {arg ? arg[0] : '\0', '\0'};
+                spec[n++] = 's';
+                spec[n] = '\0';
+                printf(spec, conv == 's' ? (arg ? arg : "") : first);
+            } else if (strchr("fFeEgG", conv) != NULL) {
+                spec[n++] = conv;
+                spec[n] = '\0';
+                char *end = NULL;
+                double value = arg ? strtod(arg, &end) : 0;
+                if (arg && (end == arg || *end != '\0')) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    currstatus = 0;
+                }
+                printf(spec, value);
+            } else {
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                printf(spec, arg ? printf_number(arg) : 0LL);
+            }
+        }
+        if (!consumed)
+            break;
+    } while (*args != NULL);
+}
+
+// Do nothing successfully with 'true' or ':'
+void builtin_true(char* tokens[]) {
+    currstatus = 1;
+}
+
+// Fail with 'false'
+void builtin_false(char* tokens[]) {
+    currstatus = 0;
+}
+
+// State of the expression parser used by test
+typedef struct {
+    char **args;  // Arguments of the expression
+    int pos;      // Next argument to read
+    int count;    // Number of arguments
+    bool error;   // Set on a syntax error
+} test_t;
+
+int test_or(test_t* t);
+
+// Reports whether op is a binary operator of test
+int is_test_binary(const char* op) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+    for (int i = 0; ops[i] != NULL; i++)
+        if (strcmp(op, ops[i]) == 0)
+            return 1;
+    return 0;
+}
+
+// Converts an integer operand of test
+long long test_number(test_t* t, const char* arg) {
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0') {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        t->error = true;
+    }
+    return n;
+}
+
+// Evaluates a single test: a unary file or string test, a binary comparison, a
+// parenthesized expression, or a lone string that is true when it is not empty
+int test_primary(test_t* t) {
+    if (t->pos >= t->count) {
+        t->error = true;
+        return 0;
+    }
+    char *a = t->args[t->pos];
+
+    // A binary operator in the middle wins, so that "-n = -n" compares strings
+    if (t->pos + 2 < t->count && is_test_binary(t->args[t->pos + 1])) {
+        char *op = t->args[t->pos + 1], *b = t->args[t->pos + 2];
+        t->pos += 3;
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+        if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+        if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+        if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+        if (op[1] != 'n' && op[1] != 'o' && strcmp(op, "-ef") != 0) {
+            long long x = test_number(t, a), y = test_number(t, b);
+            if (strcmp(op, "-eq") == 0) return x == y;
+            if (strcmp(op, "-ne") == 0) return x != y;
+            if (strcmp(op, "-lt") == 0) return x < y;
+            if (strcmp(op, "-le") == 0) return x <= y;
+            if (strcmp(op, "-gt") == 0) return x > y;
+            return x >= y;
+        }
+        struct stat sa, sb;
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (strcmp(op, "-ef") == 0)
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (strcmp(op, "-nt") == 0)
+            return ha && (!hb || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                          (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+        return hb && (!ha || sa.st_mtim.tv_sec < sb.st_mtim.tv_sec ||
+                      (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec));
+    }
+
+    if (strcmp(a, "(") == 0 && t->pos + 1 < t->count) {
+        t->pos++;
+        int value = test_or(t);
+        if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0) {
+            fprintf(stderr, "test: missing ')'\n");
+            t->error = true;
+            return 0;
+        }
+        t->pos++;
+        return value;
+    }
+
+    if (a[0] == '-' && a[1] != '\0' && a[2] == '\0' && strchr("bcdefghLnprsSwxzt", a[1]) != NULL && t->pos + 1 < t->count) {
+        char *b = t->args[t->pos + 1];
+        t->pos += 2;
+        struct stat sbuf;
+        switch (a[1]) {
+        case 'n': return b[0] != '\0';
+        case 'z': return b[0] == '\0';
+        case 't': return isatty(atoi(b));
+        case 'r': return access(b, R_OK) == 0;
+        case 'w': return access(b, W_OK) == 0;
+        case 'x': return access(b, X_OK) == 0;
+        case 'h': case 'L': return lstat(b, &sbuf) == 0 && S_ISLNK(sbuf.st_mode);
+        }
+        if (stat(b, &sbuf) != 0)
+            return 0;
+        switch (a[1]) {
+        case 'b': return S_ISBLK(sbuf.st_mode);
+        case 'c': return S_ISCHR(sbuf.st_mode);
+        case 'd': return S_ISDIR(sbuf.st_mode);
+        case 'f': return S_ISREG(sbuf.st_mode);
+        case 'g': return (sbuf.st_mode & S_ISGID) != 0;
+        case 'p': return S_ISFIFO(sbuf.st_mode);
+        case 's': return sbuf.st_size > 0;
+        case 'S': return S_ISSOCK(sbuf.st_mode);
+        default: return 1; // -e
+        }
+    }
+
+    t->pos++;
+    return a[0] != '\0';
+}
+
+// Evaluates '!' negations
+int test_not(test_t* t) {
+    if (t->pos + 1 < t->count && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+// Evaluates a chain joined by -a, which binds tighter than -o
+int test_and(test_t* t) {
+    int value = test_not(t);
+    while (t->pos < t->count && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        value = test_not(t) && value;
+    }
+    return value;
+}
+
+// Evaluates a chain joined by -o
+int test_or(test_t* t) {
+    int value = test_and(t);
+    while (t->pos < t->count && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        value = test_and(t) || value;
+    }
+    return value;
+}
+
+// Evaluate a condition with 'test expr' or '[ expr ]'
+void builtin_test(char* tokens[]) {
+    test_t t = {tokens + 1, 0, 0, false};
+    while (t.args[t.count] != NULL)
+        t.count++;
+    if (strcmp(tokens[0], "[") == 0) {
+        if (t.count == 0 || strcmp(t.args[t.count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            currstatus = 0;
+            return;
+        }
+        t.count--;
+    }
+    if (t.count == 0) { // An empty expression is false
+        currstatus = 0;
+        return;
+    }
+    int value = test_or(&t);
+    if (!t.error && t.pos < t.count) {
+        fprintf(stderr, "test: %s: unexpected argument\n", t.args[t.pos]);
+        t.error = true;
+    }
+    currstatus = !t.error && value;
+}
+
+// Finds the builtin with the given name in the sorted builtin table, or returns NULL
+const builtin_t *find_builtin(const char* name) {
+    int lo = 0, hi = sizeof(builtins) / sizeof(builtins[0]) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, builtins[mid].name);
+        if (cmp == 0)
+            return &builtins[mid];
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+// Returns the builtin that runs this command line, or NULL if it is an external command.
+// infd is the stdin chosen for a pipeline stage, or -1 when it is the shell's own.
+const builtin_t *builtin_for(char* tokens[], int infd) {
+    const builtin_t *b = find_builtin(tokens[0]);
+    if (b != NULL && b->handles != NULL && !b->handles(tokens, infd))
+        return NULL;
+    return b;
+}
+
+// Reports whether a cat or tee invocation can be handled by the builtin: it must not use
+// options other than tee's -a, and it must not read from the terminal inside the shell
+// itself. infd is the stdin already chosen for a pipeline stage, or -1 for the shell's.
+int copy_builtin_handles(char* tokens[], int infd) {
+    bool tee = strcmp(tokens[0], "tee") == 0;
+    bool reads_stdin = tee, redirected = infd >= 0;
+    int files = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        if (tokens[i] == op_input || tokens[i] == op_here_text) {
+            redirected = true;
+            i++;
+        } else if (tokens[i] == op_output) {
+            i++;
+        } else if (strcmp(tokens[i], "-") == 0) {
+            reads_stdin = true;
+        } else if (tokens[i][0] == '-' && !(tee && strcmp(tokens[i], "-a") == 0)) {
+            return 0; // Options are left to the real command
+        } else if (tokens[i][0] != '-') {
+            files++;
+        }
+    }
+    if (files == 0)
+        reads_stdin = true;
+    return !reads_stdin || redirected || !isatty(STDIN_FILENO);
+}
+
+// Copies everything from infd to outfd with the cheapest method the two descriptors allow:
+// splice when either side is a pipe, copy_file_range between regular files, sendfile from
+// a regular file, and otherwise a read/write loop with a large buffer.
+// Returns 0 on success, or -1 with errno set.
+int copy_fd(int infd, int outfd) {
+    struct stat in, out;
+    if (fstat(infd, &in) != 0 || fstat(outfd, &out) != 0)
+        return -1;
+
+    // Each zero-copy method is tried until it moves data; one that is refused before anything
+    // was copied hands over to the next (a file opened for appending cannot be spliced to).
+    if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode)) {
+        ssize_t n;
+        bool moved = false;
+        while ((n = splice(infd, NULL, outfd, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0)
+            moved = true;
+        if (n == 0)
+            return 0;
+        if (moved || (errno != EINVAL && errno != ENOSYS))
+            return -1;
+    }
+    if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode)) {
+        ssize_t n;
+        bool moved = false;
+        while ((n = copy_file_range(infd, NULL, outfd, NULL, COPY_CHUNK, 0)) > 0)
+            moved = true;
+        if (n == 0)
+            return 0;
+        if (moved || (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EBADF))
+            return -1;
+    }
+    if (S_ISREG(in.st_mode)) {
+        ssize_t n;
+        bool moved = false;
+        while ((n = sendfile(outfd, infd, NULL, COPY_CHUNK)) > 0)
+            moved = true;
+        if (n == 0)
+            return 0;
+        if (moved || (errno != EINVAL && errno != ENOSYS))
+            return -1;
+    }
+
+    char *buf = malloc(COPY_CHUNK);
+    ssize_t n;
+    while ((n = read(infd, buf, COPY_CHUNK)) > 0)
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(outfd, buf + done, n - done);
+            if (w < 0) {
+                free(buf);
+                return -1;
+            }
+            done += w;
+        }
+    free(buf);
+    return n < 0 ? -1 : 0;
+}
+
+// Concatenate files to stdout with 'cat [file|- ...]'
+void builtin_cat(char* tokens[]) {
+    fflush(stdout); // Earlier buffered output goes first
+    currstatus = 1;
+    bool any = false;
+    for (int i = 1; tokens[i] != NULL || !any; i++) {
+        const char *name = tokens[i] != NULL ? tokens[i] : "-";
+        any = true;
+        int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            currstatus = 0;
+            continue;
+        }
+        if (copy_fd(fd, STDOUT_FILENO) != 0) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            currstatus = 0;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+        if (tokens[i] == NULL)
+            break;
+    }
+}
+
+// Copy stdin to stdout and to each file with 'tee [-a] [file ...]'. With a pipe on both
+// sides and one file, tee(2) duplicates the data into stdout and splice moves the same
+// bytes into the file, so nothing passes through user space.
+void builtin_tee(char* tokens[]) {
+    fflush(stdout);
+    currstatus = 1;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int first = 1;
+    if (tokens[1] != NULL && strcmp(tokens[1], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        first = 2;
+    }
+    int nfiles = 0;
+    while (tokens[first + nfiles] != NULL)
+        nfiles++;
+    int *outs = arena_alloc(&command_arena, (nfiles + 1) * sizeof(int));
+    int nouts = 0;
+    outs[nouts++] = STDOUT_FILENO;
+    for (int i = first; tokens[i] != NULL; i++) {
+        int fd = open(tokens[i], flags, 0640);
+        if (fd < 0) {
+            fprintf(stderr, "tee: %s: %s\n", tokens[i], strerror(errno));
+            currstatus = 0;
+        } else {
+            outs[nouts++] = fd;
+        }
+    }
+
+    struct stat in, out;
+    bool zero_copy = nouts == 2 && fstat(STDIN_FILENO, &in) == 0 && fstat(STDOUT_FILENO, &out) == 0 &&
+                     S_ISFIFO(in.st_mode) && S_ISFIFO(out.st_mode);
+    char *buf = malloc(COPY_CHUNK);
+    while (1) {
+        ssize_t n;
+        if (zero_copy) {
+            n = tee(STDIN_FILENO, STDOUT_FILENO, COPY_CHUNK, 0);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                zero_copy = false;
+                continue;
+            }
+            if (n <= 0)
+                break;
+            // Consume exactly the bytes that were duplicated, into the file
+            ssize_t left = n, m = 0;
+            while (left > 0 && (m = splice(STDIN_FILENO, NULL, outs[1], NULL, left, SPLICE_F_MOVE)) > 0)
+                left -= m;
+            if (left > 0) { // The file refused splice, copy the rest of this chunk by hand
+                if (read(STDIN_FILENO, buf, left) != left || write(outs[1], buf, left) != left)
+                    currstatus = 0;
+                zero_copy = false;
+            }
+            continue;
+        }
+
+        n = read(STDIN_FILENO, buf, COPY_CHUNK);
+        if (n <= 0)
+            break;
+        for (int i = 0; i < nouts; i++)
+            if (outs[i] >= 0)
+                for (ssize_t done = 0; done < n;) {
+                    ssize_t w = write(outs[i], buf + done, n - done);
+                    if (w < 0) {
+                        if (i > 0) // A failing file is dropped, the others keep receiving data
+                            close(outs[i]);
+                        outs[i] = -1;
+                        currstatus = 0;
+                        break;
+                    }
+                    done += w;
+                }
+    }
+    free(buf);
+    for (int i = 1; i < nouts; i++)
+        if (outs[i] >= 0)
+            close(outs[i]);
+}
+
+// Execute built-in shell commands
+void execute_builtin_command(char* tokens[]) {
+    const builtin_t *b = find_builtin(tokens[0]);
+    shell_changed |= b->shell_state;
+    b->run(tokens);
+}
+
+// Removes redirection symbols and their file names from tokens, recording the files in r
+void collect_redirection(char* tokens[], redirect_t* r) {
+    r->input_file = r->input_data = r->output_file = NULL;
+
+    int kept = 0;
+    for (int i = 0; tokens[i] != NULL; i++) {
+        if (tokens[i] == op_input && tokens[i + 1] != NULL) { // Input redirection
+            r->input_file = tokens[++i];
+            r->input_data = NULL;
+        } else if (tokens[i] == op_here_text && tokens[i + 1] != NULL) {
+            r->input_data = tokens[++i]; // Here-document or here-string text
+            r->input_file = NULL;
+        } else if (tokens[i] == op_output && tokens[i + 1] != NULL) { // Output redirection
+            r->output_file = tokens[++i];
+        } else {
+            tokens[kept++] = tokens[i]; // Ordinary argument, keep it
+        }
+    }
+    tokens[kept] = NULL;
+}
+
+// Returns a descriptor to read text from, for here-documents and here-strings. Text that
+// fits in a pipe's buffer is written straight into a pipe; anything larger goes into an
+// anonymous memory file. Either way nothing touches the filesystem or needs a process.
+int open_input_data(const char* text) {
+    size_t len = strlen(text);
+    int fd = -1, p[2];
+    if (pipe2(p, O_CLOEXEC) == 0) {
+        int size = fcntl(p[1], F_GETPIPE_SZ);
+        if (size > 0 && len <= (size_t)size) {
+            fd = p[1];
+        } else {
+            close(p[0]);
+            close(p[1]);
+        }
+    }
+    if (fd < 0 && (fd = memfd_create("mysh-heredoc", MFD_CLOEXEC)) < 0)
+        return -1;
+
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n < 0) {
+            if (fd == p[1])
+                close(p[0]);
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    if (fd == p[1]) { // The reader sees end of file once the text is consumed
+        close(p[1]);
+        return p[0];
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Opens the files of a redirection. The descriptors are stored in infd/outfd (-1 when unused)
+// and are close-on-exec, so they only reach a command through an explicit dup2.
+// Returns 0 on success, or -1 after printing the error.
+int open_redirection(redirect_t* r, int* infd, int* outfd) {
+    *infd = *outfd = -1;
+    if (r->input_data != NULL) {
+        *infd = open_input_data(r->input_data);
+        if (*infd < 0) {
+            perror("here-document");
+            return -1;
+        }
+    } else if (r->input_file != NULL) {
+        *infd = open(r->input_file, O_RDONLY | O_CLOEXEC);
+        if (*infd < 0) {
+            perror("open input file");
+            return -1;
+        }
+    }
+    if (r->output_file != NULL) {
+        *outfd = open(r->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+        if (*outfd < 0) {
+            perror("open output file");
+            if (*infd >= 0)
+                close(*infd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Checks for and performs input/output redirection in the current process, for a builtin or
+// function. The descriptors it replaces are kept in saved for restore_redirection.
+// Returns 0 on success, or -1 if a file could not be opened.
+int check_redirection(char *tokens[], int saved[2]) {
+    redirect_t r;
+    int fds[2];
+    saved[0] = saved[1] = -1;
+    collect_redirection(tokens, &r);
+    if (open_redirection(&r, &fds[0], &fds[1]) < 0)
+        return -1;
+
+    // Only a descriptor that is replaced is saved, in a copy that commands do not inherit
+    for (int i = 0; i < 2; i++)
+        if (fds[i] >= 0) {
+            saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+    return 0;
+}
+
+// Puts back the stdin and stdout that check_redirection replaced
+void restore_redirection(int saved[2]) {
+    for (int i = 0; i < 2; i++)
+        if (saved[i] >= 0) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+}
+
+// Reports whether a posix_spawn error came from executing the program itself,
+// as opposed to the spawn mechanism being unavailable.
+int is_exec_error(int err) {
+    return err == ENOENT || err == EACCES || err == ENOEXEC || err == ENOTDIR || err == ELOOP ||
+           err == ENAMETOOLONG || err == E2BIG || err == ETXTBSY || err == EISDIR || err == EPERM;
+}
+
+// Puts the calling child into process group pgid (a new group when 0) and, when the shell
+// owns the terminal, makes a new foreground group the terminal's foreground group.
+void enter_process_group(pid_t pgid, bool foreground) {
+    setpgid(0, pgid);
+    if (pgid == 0 && foreground && terminal_owned)
+        tcsetpgrp(STDIN_FILENO, getpid());
+    signal(SIGTTOU, SIG_DFL);
+}
+
+// Gives the terminal back to the shell after a foreground pipeline has finished
+void reclaim_terminal() {
+    if (terminal_owned)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+}
+
+// Starts an external command with stdin/stdout taken from infd/outfd (-1 keeps the shell's),
+// in process group pgid (a new group led by the command when 0, which takes the terminal
+// when it is a foreground group).
+// posix_spawn lets the child share the shell's memory until it execs, so no page tables are
+// copied; the redirections are applied in the child through spawn file actions.
+// fork() is only used if spawning itself is unsupported.
+// Returns the child's pid, or -1 with errno set if the command could not be executed.
+pid_t launch_command(const char* path, char* argv[], int infd, int outfd, pid_t pgid, bool foreground) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+#ifdef SPAWN_HAS_TCSETPGRP
+    // A new foreground group takes the terminal before anything else runs in it
+    if (pgid == 0 && foreground && terminal_owned)
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+    if (infd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+    if (outfd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+
+    // The shell ignores SIGTTOU to take the terminal back; commands get the default action
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    update_environ();
+    long long start = TRACING ? now_ns() : 0;
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    if (TRACING)
+        trace_event(TRACE_SPAWN, start, path, err == 0 ? pid : -1);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err == 0) {
+#ifndef SPAWN_HAS_TCSETPGRP
+        if (pgid == 0 && foreground && terminal_owned)
+            tcsetpgrp(STDIN_FILENO, pid);
+#endif
+        return pid;
+    }
+    if (is_exec_error(err)) {
+        errno = err;
+        return -1;
+    }
+
+    // Fall back to duplicating the shell
+    pid = fork();
+    if (pid == 0) { // Child process
+        enter_process_group(pgid, foreground);
+        if (infd >= 0)
+            dup2(infd, STDIN_FILENO);
+        if (outfd >= 0)
+            dup2(outfd, STDOUT_FILENO);
+        execv(path, argv); // Execute the command
+        perror("execv"); // Execv should not return, print an error if it does
+        _exit(EXIT_FAILURE);
+    } else if (pid > 0) {
+        setpgid(pid, pgid ? pgid : pid); // Also set here so the group exists when the parent continues
+    } else {
+        perror("fork"); // Forking failed
+    }
+    return pid;
+}
+
+// Raises the soft limit on open descriptors, since every background process holds a pidfd
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Adds a job for the pipeline processes in pids (entries <= 0 are skipped) and starts
+// watching each of them through a pidfd registered with the job epoll instance.
+job_t *add_job(pid_t pgid, pid_t pids[], int n, bool stopped) {
+    shell_changed = true;
+    if (job_epoll < 0) {
+        job_epoll = epoll_create1(EPOLL_CLOEXEC);
+        raise_fd_limit();
+    }
+    if (njobs == jobs_capacity) {
+        jobs_capacity = jobs_capacity ? jobs_capacity * 2 : 16;
+        jobs = realloc(jobs, jobs_capacity * sizeof(job_t*));
+    }
+
+    job_t *job = calloc(1, sizeof(job_t));
+    job->id = njobs > 0 ? jobs[njobs - 1]->id + 1 : 1;
+    job->pgid = pgid;
+    job->stopped = stopped;
+    job->command = strdup(current_line != NULL ? current_line : "");
+    job->procs = calloc(n, sizeof(job_proc_t));
+    for (int i = 0; i < n; i++) {
+        if (pids[i] <= 0)
+            continue;
+        job_proc_t *proc = &job->procs[job->nprocs++];
+        proc->job = job;
+        proc->pid = pids[i];
+        proc->pidfd = syscall(SYS_pidfd_open, pids[i], 0);
+        if (proc->pidfd >= 0) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = proc;
+            epoll_ctl(job_epoll, EPOLL_CTL_ADD, proc->pidfd, &ev);
+        } else {
+            unwatched_procs++; // No pidfd support, reap_jobs polls this one with waitpid
+        }
+        job->running++;
+    }
+    job->status = 1;
+    jobs[njobs++] = job;
+    return job;
+}
+
+// Records the wait status of a job process that has been reaped
+void finish_proc(job_proc_t* proc, int status) {
+    job_t *job = proc->job;
+    if (proc->pidfd >= 0)
+        close(proc->pidfd); // Closing it also removes it from the epoll set
+    else
+        unwatched_procs--;
+    // The status of a pipeline is the status of its last command
+    if (proc == &job->procs[job->nprocs - 1])
+        job->status = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    proc->pid = 0;
+    proc->pidfd = -1;
+    job->running--;
+}
+
+// Reaps background processes that have exited. Waits up to timeout milliseconds
+// (-1 for no limit) for the first one; returns the number of processes reaped.
+int reap_jobs(int timeout) {
+    int reaped = 0;
+    struct epoll_event events[64];
+    int n = job_epoll >= 0 ? epoll_wait(job_epoll, events, 64, unwatched_procs > 0 ? 0 : timeout) : 0;
+    for (int i = 0; i < n; i++) {
+        // A readable pidfd means the process has exited, so this does not block
+        job_proc_t *proc = events[i].data.ptr;
+        int status;
+        if (waitpid(proc->pid, &status, 0) == proc->pid) {
+            finish_proc(proc, status);
+            reaped++;
+        }
+    }
+
+    // Processes without a pidfd are checked one by one
+    if (unwatched_procs > 0) {
+        for (int j = 0; j < njobs; j++)
+            for (int k = 0; k < jobs[j]->nprocs; k++) {
+                job_proc_t *proc = &jobs[j]->procs[k];
+                int status;
+                if (proc->pid > 0 && proc->pidfd < 0 && waitpid(proc->pid, &status, WNOHANG) == proc->pid) {
+                    finish_proc(proc, status);
+                    reaped++;
+                }
+            }
+        if (reaped == 0 && timeout != 0)
+            usleep(10000);
+    }
+    return reaped;
+}
+
+// Removes a job from the table and frees it
+void remove_job(job_t* job) {
+    for (int i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pidfd >= 0)
+            close(job->procs[i].pidfd);
+    for (int i = 0; i < njobs; i++)
+        if (jobs[i] == job) {
+            memmove(&jobs[i], &jobs[i + 1], (njobs - i - 1) * sizeof(job_t*));
+            njobs--;
+            break;
+        }
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+// Prints one line of the job table
+void print_job(job_t* job) {
+    const char *state = job->running == 0 ? (job->status ? "Done" : "Exit") : job->stopped ? "Stopped" : "Running";
+    printf("[%d]  %-8s %s\n", job->id, state, job->command);
+}
+
+// Reports background jobs that finished since the last prompt and forgets them
+void notify_jobs() {
+    reap_jobs(0);
+    for (int i = 0; i < njobs; i++)
+        if (jobs[i]->running == 0) {
+            print_job(jobs[i]);
+            remove_job(jobs[i--]);
+        }
+    fflush(stdout);
+}
+
+// Finds a job from a %n argument, or the most recent job when spec is NULL
+job_t *find_job(const char* spec) {
+    if (spec == NULL)
+        return njobs > 0 ? jobs[njobs - 1] : NULL;
+    if (spec[0] == '%')
+        spec++;
+    int id = atoi(spec);
+    for (int i = 0; i < njobs; i++)
+        if (jobs[i]->id == id)
+            return jobs[i];
+    return NULL;
+}
+
+// Blocks until every process of a job has been reaped
+void wait_job(job_t* job) {
+    while (job->running > 0)
+        reap_jobs(-1);
+}
+
+// Waits for the processes of a foreground pipeline and returns the status of the last one.
+// If the user suspends the pipeline, its remaining processes become a stopped job.
+int wait_foreground(pid_t pids[], int n, pid_t pgid) {
+    int result = 0;
+    for (int i = 0; i < n; i++) {
+        int status;
+        struct rusage ru;
+        long long start = TRACING ? now_ns() : 0;
+        if (pids[i] <= 0 || wait4(pids[i], &status, WUNTRACED, &ru) < 0) {
+            result = 0;
+            continue;
+        }
+        if (TRACING)
+            trace_wait(start, pids[i], status);
+        if (!WIFSTOPPED(status))
+            add_usage(&child_usage, &ru);
+        if (WIFSTOPPED(status)) {
+            job_t *job = add_job(pgid, pids + i, n - i, true);
+            printf("\n[%d]+  Stopped  %s\n", job->id, job->command);
+            fflush(stdout);
+            result = 0;
+            break;
+        }
+        result = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        last_signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+            loop_jump = loop_depth; // Ctrl-C also stops the loops the command runs in
+    }
+    reclaim_terminal();
+    return result;
+}
+
+// Reads the monotonic clock in nanoseconds
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Starts tracing into path, which is truncated. Returns 0, or -1 with errno set.
+int trace_open(const char* path) {
+    // Forked copies of the shell write to the same file, so every write is a whole append
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace.fd < 0)
+        return -1;
+    trace.stats = mmap(NULL, sizeof(trace_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace.stats == MAP_FAILED) {
+        close(trace.fd);
+        trace.fd = -1;
+        return -1;
+    }
+    size_t len = strlen(path);
+    trace.chrome = len > 5 && strcmp(path + len - 5, ".json") == 0;
+    if (trace.chrome)
+        write(trace.fd, "[\n", 2); // The closing bracket is optional in the Chrome format
+    trace.ring = malloc(TRACE_RING * sizeof(trace_event_t));
+    trace.pid = trace.owner = getpid();
+    trace.origin_ns = now_ns();
+    atexit(trace_finish);
+    return 0;
+}
+
+// Records a step of the given phase that started at start_ns and ends now
+void trace_event(int phase, long long start_ns, const char* detail, long value) {
+    long long dur = now_ns() - start_ns;
+    if (trace.count == TRACE_RING)
+        trace_flush();
+    trace_event_t *e = &trace.ring[trace.count++];
+    e->start_ns = start_ns;
+    e->dur_ns = dur;
+    e->value = value;
+    e->phase = phase;
+    size_t n = detail != NULL ? strnlen(detail, sizeof(e->detail) - 1) : 0;
+    if (n > 0)
+        memcpy(e->detail, detail, n);
+    e->detail[n] = '\0';
+
+    // Bucket b holds durations from 2^(b-1) up to 2^b nanoseconds
+    int bucket = dur > 0 ? 64 - __builtin_clzll(dur) : 0;
+    if (bucket >= TRACE_BUCKETS)
+        bucket = TRACE_BUCKETS - 1;
+    trace_stats_t *stats = trace.stats;
+    __atomic_add_fetch(&stats->histogram[phase][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->total_ns[phase], dur, __ATOMIC_RELAXED);
+    long long max = __atomic_load_n(&stats->max_ns[phase], __ATOMIC_RELAXED);
+    while (dur > max &&
+           !__atomic_compare_exchange_n(&stats->max_ns[phase], &max, dur, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&stats->events, 1, __ATOMIC_RELAXED);
+}
+
+// Records waiting for a child that ended, or stopped, with the given wait status
+void trace_wait(long long start_ns, pid_t pid, int status) {
+    char how[32];
+    if (WIFSTOPPED(status))
+        snprintf(how, sizeof(how), "stopped");
+    else if (WIFSIGNALED(status))
+        snprintf(how, sizeof(how), "signal %d", WTERMSIG(status));
+    else
+        snprintf(how, sizeof(how), "exit %d", WEXITSTATUS(status));
+    trace_event(TRACE_WAIT, start_ns, how, pid);
+}
+
+// Writes the events in the ring to the trace file, one Chrome trace event object per line,
+// in as few writes as possible. Each write ends at the end of a line, so the lines of
+// processes writing at the same time do not mix.
+void trace_flush() {
+    if (trace.fd < 0 || trace.count == 0)
+        return;
+    char buf[65536];
+    size_t len = 0;
+    for (int i = 0; i < trace.count; i++) {
+        trace_event_t *e = &trace.ring[i];
+        if (len > sizeof(buf) - 512) {
+            write(trace.fd, buf, len);
+            len = 0;
+        }
+        long long ts = e->start_ns - trace.origin_ns;
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %lld.%03lld, \"dur\": %lld.%03lld, "
+                        "\"pid\": %d, \"tid\": %d, \"args\": {\"detail\": \"",
+                        trace_phase_names[e->phase], ts / 1000, ts % 1000, e->dur_ns / 1000, e->dur_ns % 1000,
+                        trace.pid, trace.pid);
+        for (const char *c = e->detail; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\')
+                len += snprintf(buf + len, sizeof(buf) - len, "\\%c", *c);
+            else if ((unsigned char)*c < 0x20)
+                len += snprintf(buf + len, sizeof(buf) - len, "\\u%04x", *c);
+            else
+                buf[len++] = *c;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "\", \"value\": %ld}}%s\n", e->value, trace.chrome ? "," : "");
+    }
+    write(trace.fd, buf, len);
+    trace.count = 0;
+}
+
+// Called first in a forked copy of the shell: the events it inherited are the parent's to
+// write, and what it records from now on is written under its own pid
+void trace_child() {
+    if (trace.fd < 0)
+        return;
+    trace.count = 0;
+    trace.pid = getpid();
+}
+
+// Formats a duration with a unit that keeps it short
+void format_duration(long long ns, char* buf, size_t size) {
+    if (ns < 1000)
+        snprintf(buf, size, "%lldns", ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+// Writes out the last events at exit. The shell that started tracing then prints, for each
+// step of all its copies that have finished by then, how often it ran, its total, mean, median, 99th percentile and longest duration and
+// a histogram of its durations to stderr. The percentiles are the upper bounds of the
+// power-of-two buckets they fall in.
+void trace_finish() {
+    trace_flush();
+    if (trace.fd < 0 || getpid() != trace.owner)
+        return;
+    trace_stats_t *stats = trace.stats;
+    fprintf(stderr, "trace: %lld events\n%-7s %9s %9s %9s %9s %9s %9s\n", stats->events, "step", "count",
+            "total", "mean", "p50", "p99", "max");
+    for (int p = 0; p < TRACE_PHASES; p++) {
+        unsigned long long count = 0, most = 0, seen = 0;
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            count += stats->histogram[p][b];
+            if (stats->histogram[p][b] > most)
+                most = stats->histogram[p][b];
+        }
+        if (count == 0)
+            continue;
+        char total[16], mean[16], p50[16], p99[16], max[16];
+        long long q50 = -1, q99 = -1;
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            seen += stats->histogram[p][b];
+            long long bound = b == 0 ? 0 : 1LL << b;
+            if (bound > stats->max_ns[p])
+                bound = stats->max_ns[p];
+            if (q50 < 0 && seen * 2 >= count)
+                q50 = bound;
+            if (q99 < 0 && seen * 100 >= count * 99)
+                q99 = bound;
+        }
+        format_duration(stats->total_ns[p], total, sizeof(total));
+        format_duration(stats->total_ns[p] / count, mean, sizeof(mean));
+        format_duration(q50, p50, sizeof(p50));
+        format_duration(q99, p99, sizeof(p99));
+        format_duration(stats->max_ns[p], max, sizeof(max));
+        fprintf(stderr, "%-7s %9llu %9s %9s %9s %9s %9s\n", trace_phase_names[p], count, total, mean, p50, p99, max);
+
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            if (stats->histogram[p][b] == 0)
+                continue;
+            char low[16], high[16];
+            format_duration(b == 0 ? 0 : 1LL << (b - 1), low, sizeof(low));
+            format_duration(1LL << b, high, sizeof(high));
+            int width = (int)((stats->histogram[p][b] * 40 + most - 1) / most);
+            fprintf(stderr, "  %8s - %-8s %9llu %.*s\n", low, high, stats->histogram[p][b], width,
+                    "########################################");
+        }
+    }
+}
+
+// Adds the CPU times and context switches of ru to total and keeps the larger peak RSS
+void add_usage(struct rusage* total, const struct rusage* ru) {
+    timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+    if (ru->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = ru->ru_maxrss;
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+// Prints what a timed command used to stderr and, with -o, appends it to output as a JSON line
+void report_time(const char* command, long long real_ns, const struct rusage* ru, const char* output) {
+    double user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    double sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    fprintf(stderr, "real    %.6fs\nuser    %.6fs\nsys     %.6fs\n", real_ns / 1e9, user, sys);
+    fprintf(stderr, "maxrss  %ld KB\nctxsw   %ld voluntary, %ld involuntary\n", ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+    fprintf(stderr, "parse   %.6fs\nspawn   %.6fs\n", parse_ns / 1e9, spawn_ns / 1e9);
+    if (output == NULL)
+        return;
+
+    FILE *f = fopen(output, "ae");
+    if (f == NULL) {
+        perror("time: open output file");
+        return;
+    }
+    fputs("{\"command\": \"", f);
+    for (const char *c = command; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fprintf(f, "\", \"success\": %s, \"real\": %.6f, \"user\": %.6f, \"sys\": %.6f, \"maxrss_kb\": %ld, ",
+            currstatus ? "true" : "false", real_ns / 1e9, user, sys, ru->ru_maxrss);
+    fprintf(f, "\"voluntary_ctxsw\": %ld, \"involuntary_ctxsw\": %ld, \"parse\": %.6f, \"spawn\": %.6f}\n",
+            ru->ru_nvcsw, ru->ru_nivcsw, parse_ns / 1e9, spawn_ns / 1e9);
+    fclose(f);
+}
+
+// Folds len bytes into a 128-bit FNV-1a hash
+hash128_t hash_bytes(hash128_t h, const void* data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * HASH128_PRIME;
+    return h;
+}
+
+// Folds in what a command can see of a file: its identity, size and modification time, like
+// make does. A file changed within the last second may change again without its timestamp
+// moving, so its contents are hashed instead.
+hash128_t hash_file_state(hash128_t h, const char* path) {
+    struct stat sbuf;
+    h = hash_bytes(h, path, strlen(path) + 1);
+    if (stat(path, &sbuf) < 0)
+        return hash_bytes(h, "missing", 8);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!S_ISREG(sbuf.st_mode) || now.tv_sec - sbuf.st_mtim.tv_sec > 1) {
+        long long state[5] = {sbuf.st_dev, sbuf.st_ino, sbuf.st_size, sbuf.st_mtim.tv_sec, sbuf.st_mtim.tv_nsec};
+        return hash_bytes(h, state, sizeof(state));
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return hash_bytes(h, "unreadable", 11);
+    char *buf = malloc(COPY_CHUNK);
+    ssize_t n;
+    while ((n = read(fd, buf, COPY_CHUNK)) > 0)
+        h = hash_bytes(h, buf, n);
+    free(buf);
+    close(fd);
+    return hash_bytes(h, "contents", 9);
+}
+
+// Writes h as 32 hexadecimal digits
+void hash_hex(hash128_t h, char hex[33]) {
+    snprintf(hex, 33, "%016llx%016llx", (unsigned long long)(h >> 64), (unsigned long long)h);
+}
+
+// Returns the cache directory ($MYSH_CACHE_DIR, $XDG_CACHE_HOME/mysh or ~/.cache/mysh),
+// creating it with its keys and objects subdirectories, or NULL if there is none
+const char *cache_dir() {
+    static char dir[PATH_MAX];
+    const char *base = get_variable("MYSH_CACHE_DIR"), *xdg = get_variable("XDG_CACHE_HOME");
+    const char *home = get_variable("HOME");
+    if (base != NULL && base[0] != '\0')
+        snprintf(dir, sizeof(dir), "%s", base);
+    else if (xdg != NULL && xdg[0] != '\0')
+        snprintf(dir, sizeof(dir), "%s/mysh", xdg);
+    else if (home != NULL)
+        snprintf(dir, sizeof(dir), "%s/.cache/mysh", home);
+    else
+        return NULL;
+
+    char sub[PATH_MAX + 16];
+    snprintf(sub, sizeof(sub), "%s/objects", dir);
+    if (access(sub, W_OK) == 0)
+        return dir;
+    for (char *p = dir + 1; *p != '\0'; p++)
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0700);
+            *p = '/';
+        }
+    mkdir(dir, 0700);
+    mkdir(sub, 0700);
+    snprintf(sub, sizeof(sub), "%s/keys", dir);
+    mkdir(sub, 0700);
+    return dir;
+}
+
+// Runs a single command with infd and outfd, when not -1, as its stdin and stdout
+void run_with_fds(char* tokens[], int infd, int outfd) {
+    int saved[2] = {-1, -1}, fds[2] = {infd, outfd};
+    fflush(stdout);
+    for (int i = 0; i < 2; i++)
+        if (fds[i] >= 0 && fds[i] != i) {
+            saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+            dup2(fds[i], i);
+        }
+    last_signal = 0;
+    execute_command(tokens);
+    fflush(stdout);
+    restore_redirection(saved);
+}
+
+// 'cache [-d file]... command' replays the output and status the command had the last time
+// it ran with the same arguments, executable, '<' input and dependency files, from the same
+// directory. The store holds each distinct output once, in objects/ named by the hash of
+// its contents; keys/ maps the hash of everything the command depends on to its status and
+// output. Both are touched on use, so eviction can drop the least recently used first.
+void execute_cached(char* tokens[]) {
+    char cwd[PATH_MAX];
+    hash128_t key = hash_bytes(HASH128_BASIS, "mysh cache 1", 13);
+    while (tokens[0] != NULL && strcmp(tokens[0], "-d") == 0 && tokens[1] != NULL) {
+        key = hash_file_state(key, tokens[1]);
+        tokens += 2;
+    }
+    if (tokens[0] == NULL || tokens[0] == op_output || tokens[0] == op_input) {
+        fprintf(stderr, "cache: usage: cache [-d file]... command [args...]\n");
+        currstatus = 0;
+        return;
+    }
+    if (check_pipe(tokens) != 0) {
+        fprintf(stderr, "cache: only a single command can be cached\n");
+        currstatus = 0;
+        return;
+    }
+
+    // Functions and builtins that change the shell are run every time, since their output
+    // is not all they do. So is anything when there is nowhere to keep the output.
+    const builtin_t *b = find_builtin(tokens[0]);
+    const char *dir = cache_dir();
+    if (dir == NULL || find_function(tokens[0]) != NULL || (b != NULL && b->shell_state)) {
+        execute_command(tokens);
+        return;
+    }
+
+    redirect_t r;
+    int infd, outfd;
+    collect_redirection(tokens, &r);
+    if (open_redirection(&r, &infd, &outfd) < 0) {
+        currstatus = 0;
+        return;
+    }
+    int dest = outfd >= 0 ? outfd : STDOUT_FILENO;
+
+    const char *path = NULL;
+    if (builtin_for(tokens, infd) != NULL)
+        key = hash_bytes(key, "builtin", 8);
+    else if ((path = check_slash(tokens[0]) ? tokens[0] : lookup_command(tokens[0])) != NULL)
+        key = hash_file_state(key, path);
+    for (int i = 0; tokens[i] != NULL; i++)
+        key = hash_bytes(key, tokens[i], strlen(tokens[i]) + 1);
+    if (r.input_data != NULL)
+        key = hash_bytes(hash_bytes(key, "<<", 3), r.input_data, strlen(r.input_data) + 1);
+    else if (r.input_file != NULL)
+        key = hash_file_state(hash_bytes(key, "<", 2), r.input_file);
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        key = hash_bytes(key, cwd, strlen(cwd) + 1);
+
+    char key_hex[33], object_hex[33], key_path[PATH_MAX + 64], object_path[PATH_MAX + 64];
+    hash_hex(key, key_hex);
+    snprintf(key_path, sizeof(key_path), "%s/keys/%s", dir, key_hex);
+
+    // A hit: the key names an output that is still stored
+    int status, objfd = -1;
+    FILE *entry = fopen(key_path, "re");
+    if (entry != NULL) {
+        if (fscanf(entry, "%d %32s", &status, object_hex) == 2) {
+            snprintf(object_path, sizeof(object_path), "%s/objects/%s", dir, object_hex);
+            objfd = open(object_path, O_RDONLY | O_CLOEXEC);
+        }
+        fclose(entry);
+    }
+    if (objfd >= 0) {
+        futimens(objfd, NULL);
+        utimensat(AT_FDCWD, key_path, NULL, 0);
+        fflush(stdout);
+        copy_fd(objfd, dest);
+        close(objfd);
+        currstatus = status;
+    } else if (path == NULL && builtin_for(tokens, infd) == NULL) {
+        run_with_fds(tokens, infd, dest); // Not found: nothing to cache but the error
+    } else {
+        // A miss runs the command into memory, then stores its output and passes it on.
+        // A command killed by a signal did not finish, so what it wrote is not kept.
+        int memfd = memfd_create("mysh-cache", MFD_CLOEXEC);
+        if (memfd < 0) {
+            perror("memfd_create");
+            run_with_fds(tokens, infd, dest);
+        } else {
+            run_with_fds(tokens, infd, memfd);
+            if (last_signal == 0) {
+                off_t size = lseek(memfd, 0, SEEK_END);
+                hash128_t contents = HASH128_BASIS;
+                char *map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, memfd, 0) : NULL;
+                if (map != MAP_FAILED) {
+                    contents = hash_bytes(contents, map, size);
+                    if (map != NULL)
+                        munmap(map, size);
+                    hash_hex(contents, object_hex);
+                    snprintf(object_path, sizeof(object_path), "%s/objects/%s", dir, object_hex);
+
+                    // Entries are written under a temporary name and renamed into place, so a
+                    // shell reading the store concurrently never sees half of one
+                    char temp[PATH_MAX + 64];
+                    snprintf(temp, sizeof(temp), "%s/objects/.%d", dir, getpid());
+                    if (utimensat(AT_FDCWD, object_path, NULL, 0) < 0) {
+                        int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                        lseek(memfd, 0, SEEK_SET);
+                        if (fd >= 0 && copy_fd(memfd, fd) == 0 && close(fd) == 0)
+                            rename(temp, object_path);
+                        else
+                            unlink(temp);
+                    }
+                    snprintf(temp, sizeof(temp), "%s/keys/.%d", dir, getpid());
+                    FILE *out = fopen(temp, "we");
+                    if (out != NULL) {
+                        fprintf(out, "%d %s\n", currstatus, object_hex);
+                        if (fclose(out) == 0)
+                            rename(temp, key_path);
+                        else
+                            unlink(temp);
+                    }
+                    evict_cache(dir);
+                }
+            }
+            lseek(memfd, 0, SEEK_SET);
+            copy_fd(memfd, dest);
+            close(memfd);
+        }
+    }
+    if (infd >= 0)
+        close(infd);
+    if (outfd >= 0)
+        close(outfd);
+}
+
+// A stored output, as seen by evict_cache()
+typedef struct {
+    struct timespec used;  // Last time a key pointed to it
+    off_t size;
+    char name[33];
+} cache_object_t;
+
+int compare_cache_objects(const void* a, const void* b) {
+    const struct timespec *x = &((const cache_object_t*)a)->used, *y = &((const cache_object_t*)b)->used;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Removes the least recently used outputs once the store holds more than cachesize megabytes,
+// and the keys not used since the newest output removed, which would mostly point to nothing
+void evict_cache(const char* dir) {
+    long long limit = (long long)(cache_size == AUTO_VALUE ? CACHE_DEFAULT_SIZE : cache_size) << 20;
+    char sub[PATH_MAX + 16];
+    snprintf(sub, sizeof(sub), "%s/objects", dir);
+    DIR *d = opendir(sub);
+    if (d == NULL)
+        return;
+    cache_object_t *objects = NULL;
+    size_t count = 0, room = 0;
+    long long total = 0;
+    struct dirent *de;
+    struct stat sbuf;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) != 32 || fstatat(dirfd(d), de->d_name, &sbuf, 0) < 0)
+            continue;
+        if (count == room) {
+            room = room ? room * 2 : 256;
+            objects = realloc(objects, room * sizeof(cache_object_t));
+        }
+        objects[count].used = sbuf.st_mtim;
+        objects[count].size = sbuf.st_blocks * 512LL;
+        memcpy(objects[count].name, de->d_name, 33);
+        total += objects[count++].size;
+    }
+    if (total > limit) {
+        qsort(objects, count, sizeof(cache_object_t), compare_cache_objects);
+        struct timespec cutoff = {0, 0};
+        for (size_t i = 0; i < count && total > limit; i++) {
+            if (unlinkat(dirfd(d), objects[i].name, 0) == 0)
+                total -= objects[i].size;
+            cutoff = objects[i].used;
+        }
+
+        snprintf(sub, sizeof(sub), "%s/keys", dir);
+        DIR *keys = opendir(sub);
+        while (keys != NULL && (de = readdir(keys)) != NULL)
+            if (de->d_name[0] != '.' && fstatat(dirfd(keys), de->d_name, &sbuf, 0) == 0 &&
+                (sbuf.st_mtim.tv_sec < cutoff.tv_sec ||
+                 (sbuf.st_mtim.tv_sec == cutoff.tv_sec && sbuf.st_mtim.tv_nsec <= cutoff.tv_nsec)))
+                unlinkat(dirfd(keys), de->d_name, 0);
+        if (keys != NULL)
+            closedir(keys);
+    }
+    closedir(d);
+    free(objects);
+}
+
+// Maps a signal name or number given to kill to its value, or -1
+int parse_signal(const char* name) {
+    static const struct { const char *name; int sig; } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+        {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}
+    };
+    if (name[0] >= '0' && name[0] <= '9')
+        return atoi(name);
+    if (strncmp(name, "SIG", 3) == 0)
+        name += 3;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        if (strcmp(signals[i].name, name) == 0)
+            return signals[i].sig;
+    return -1;
+}
+
+//check if pipe exists in the command
+//returns 1 if it does
+int check_pipe(char* tokens[]) {
+    int i = 0;
+    int state = 0;
+    while (tokens[i] != NULL) {
+        if (tokens[i] == op_pipe) {
+            state = 1;
+            break;
+        }
+        i++;
+    }
+    return state;
+}
+
+// Executes the full command with consideration for conditionals and piping.
+void execute_full(char* tokens[]) {
+    if (tokens[0] == NULL)
+        return; // Blank line
+
+    // A trailing '&' runs the command in the background
+    bool background = false;
+    for (int i = 0; tokens[i] != NULL; i++)
+        if (tokens[i] == op_background) {
+            if (tokens[i + 1] != NULL || i == 0) {
+                fprintf(stderr, "mysh: syntax error near '&'\n");
+                currstatus = 0;
+                return;
+            }
+            tokens[i] = NULL;
+            background = true;
+        }
+
+    // Handling conditional execution based on the outcome of the previous command
+    if (strcmp(tokens[0], "then") == 0) {
+        if (currstatus != 1) return; // Skip command if the previous command did not succeed
+        tokens++; // Move past the conditional token for execution
+    } else if (strcmp(tokens[0], "else") == 0) {
+        if (currstatus != 0) return; // Skip command if the previous command succeeded
+        tokens++; // Move past the conditional token for execution
+    }
+
+    // 'time [-o file]' in front of a command or pipeline reports the resources it used
+    bool timed = false;
+    const char *time_output = NULL;
+    char *timed_command = NULL;
+    if (tokens[0] != NULL && strcmp(tokens[0], "time") == 0) {
+        timed = true;
+        tokens++;
+        if (tokens[0] != NULL && strcmp(tokens[0], "-o") == 0) {
+            time_output = tokens[1];
+            tokens += tokens[1] != NULL ? 2 : 1;
+        }
+    }
+
+    if (tokens[0] == NULL) {
+        fprintf(stderr, "mysh: missing command\n");
+        currstatus = 0;
+        return;
+    }
+
+    // NAME=VALUE words alone set shell variables. In front of a command they are exported
+    // to that command only, and the previous values come back once it has finished.
+    int nassign = 0;
+    while (tokens[2 * nassign] == op_assign)
+        nassign++;
+    if (nassign > 0 && tokens[2 * nassign] == NULL) {
+        for (int i = 0; i < nassign; i++)
+            assign_variable(tokens[2 * i + 1], false);
+        if (!substituted)
+            currstatus = 1; // Otherwise the status is that of the last command substitution
+        return;
+    }
+    char **assignments = tokens, **saved_values = NULL;
+    bool *saved_exported = NULL;
+    if (nassign > 0) {
+        saved_values = arena_alloc(&command_arena, nassign * sizeof(char*));
+        saved_exported = arena_alloc(&command_arena, nassign * sizeof(bool));
+        for (int i = 0; i < nassign; i++) {
+            char *assignment = tokens[2 * i + 1];
+            variable_t *v = find_variable(assignment, strchr(assignment, '=') - assignment);
+            saved_values[i] = v != NULL && v->value != NULL ? arena_strndup(&command_arena, v->value, strlen(v->value)) : NULL;
+            saved_exported[i] = v != NULL && v->exported;
+            assign_variable(assignment, true);
+        }
+        tokens += 2 * nassign;
+    }
+
+    struct rusage self_start;
+    long long start = 0;
+    if (timed) {
+        // The command is recorded as typed, before redirections are taken out of tokens
+        size_t len = 1;
+        for (int i = 0; tokens[i] != NULL; i++)
+            len += strlen(tokens[i]) + 1;
+        timed_command = arena_alloc(&command_arena, len);
+        timed_command[0] = '\0';
+        for (int i = 0; tokens[i] != NULL; i++) {
+            if (i > 0)
+                strcat(timed_command, " ");
+            strcat(timed_command, tokens[i]);
+        }
+        memset(&child_usage, 0, sizeof(child_usage));
+        spawn_ns = 0;
+        getrusage(RUSAGE_SELF, &self_start); // Builtins run in the shell itself
+        start = now_ns();
+    }
+
+    if (strcmp(tokens[0], "cache") == 0) {
+        if (background) {
+            fprintf(stderr, "cache: a cached command cannot run in the background\n");
+            currstatus = 0;
+        } else
+            execute_cached(tokens + 1);
+    } else if (background) {
+        execute_pipeline(tokens, true);
+    } else if (check_pipe(tokens) == 0) {
+        // No pipe found, execute command normally
+        execute_command(tokens);
+    } else {
+        execute_pipeline(tokens, false);
+    }
+
+    if (timed) {
+        long long real_ns = now_ns() - start;
+        struct rusage self_end, used = child_usage;
+        getrusage(RUSAGE_SELF, &self_end);
+        timersub(&self_end.ru_utime, &self_start.ru_utime, &self_end.ru_utime);
+        timersub(&self_end.ru_stime, &self_start.ru_stime, &self_end.ru_stime);
+        self_end.ru_maxrss = 0; // The shell's own peak says nothing about the command
+        self_end.ru_nvcsw -= self_start.ru_nvcsw;
+        self_end.ru_nivcsw -= self_start.ru_nivcsw;
+        add_usage(&used, &self_end);
+        report_time(timed_command, real_ns, &used, time_output);
+    }
+
+    for (int i = nassign - 1; i >= 0; i--) { // Last first, in case a name was assigned twice
+        char *assignment = assignments[2 * i + 1];
+        size_t len = strchr(assignment, '=') - assignment;
+        if (saved_values[i] == NULL) {
+            unset_variable(arena_strndup(&command_arena, assignment, len));
+        } else {
+            variable_t *v = define_variable(assignment, len);
+            store_value(v, saved_values[i]);
+            v->exported = saved_exported[i];
+            environ_stale = true;
+        }
+    }
+}